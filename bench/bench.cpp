@@ -0,0 +1,442 @@
+// End-to-end load generator: starts a local bedweb and drives it with concurrent websocket clients.
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <json.hpp>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#ifndef BEDWEB_PATH
+#  define BEDWEB_PATH "bedweb"
+#endif
+
+using json       = nlohmann::json;
+namespace fs     = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+static constexpr uint32_t terminal_magic = (1ul << 31);
+static constexpr size_t blob_size        = 16384;
+
+struct options {
+  std::string server = BEDWEB_PATH;
+  std::string output;
+  unsigned clients  = 8;
+  unsigned requests = 2000;
+  unsigned blobs    = 256;
+  unsigned keys     = 200;
+  unsigned threads  = 1;
+  bool plain = true, tls = true;
+};
+
+// Minimal blocking websocket client, just enough protocol for the benchmark
+class ws_client {
+  int fd;
+  SSL *ssl = nullptr;
+  std::string rbuf;
+
+  void write_all(char const *data, size_t size) {
+    while (size) {
+      auto ret = ssl ? SSL_write(ssl, data, size) : ::write(fd, data, size);
+      if (ret <= 0) throw std::runtime_error("connection lost while writing");
+      data += ret;
+      size -= ret;
+    }
+  }
+
+  void fill(size_t size) {
+    char buffer[65536];
+    while (rbuf.size() < size) {
+      auto ret = ssl ? SSL_read(ssl, buffer, sizeof buffer) : ::read(fd, buffer, sizeof buffer);
+      if (ret <= 0) throw std::runtime_error("connection lost while reading");
+      rbuf.append(buffer, ret);
+    }
+  }
+
+  std::string take(size_t size) {
+    fill(size);
+    auto ret = rbuf.substr(0, size);
+    rbuf.erase(0, size);
+    return ret;
+  }
+
+public:
+  ws_client(int port, SSL_CTX *ctx) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr *) &addr, sizeof addr) != 0) {
+      close(fd);
+      throw std::runtime_error("connect failed");
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (ctx) {
+      ssl = SSL_new(ctx);
+      SSL_set_fd(ssl, fd);
+      if (SSL_connect(ssl) != 1) {
+        SSL_free(ssl);
+        close(fd);
+        throw std::runtime_error("TLS handshake failed");
+      }
+    }
+    std::string request = "GET / HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:" +
+                          std::to_string(port) +
+                          "\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n";
+    write_all(request.data(), request.size());
+    size_t end;
+    while ((end = rbuf.find("\r\n\r\n")) == std::string::npos) fill(rbuf.size() + 1);
+    if (rbuf.compare(0, 12, "HTTP/1.1 101") != 0) throw std::runtime_error("websocket upgrade rejected");
+    rbuf.erase(0, end + 4);
+  }
+
+  ~ws_client() {
+    if (ssl) {
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+    }
+    close(fd);
+  }
+
+  void send(std::string_view payload, bool binary) {
+    std::string frame;
+    frame.push_back((char) (0x80 | (binary ? 2 : 1)));
+    if (payload.size() < 126) {
+      frame.push_back((char) (0x80 | payload.size()));
+    } else if (payload.size() < 65536) {
+      frame.push_back((char) (0x80 | 126));
+      frame.push_back((char) (payload.size() >> 8));
+      frame.push_back((char) payload.size());
+    } else {
+      frame.push_back((char) (0x80 | 127));
+      for (int i = 7; i >= 0; i--) frame.push_back((char) ((uint64_t) payload.size() >> (i * 8)));
+    }
+    char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    frame.append(mask, 4);
+    auto pos = frame.size();
+    frame.append(payload);
+    for (size_t i = pos; i < frame.size(); i++) frame[i] ^= mask[(i - pos) & 3];
+    write_all(frame.data(), frame.size());
+  }
+
+  // Returns the next complete data message, the flag tells whether it is binary
+  std::pair<bool, std::string> recv() {
+    std::string message;
+    int opcode = 0;
+    while (true) {
+      auto head     = take(2);
+      auto fin      = head[0] & 0x80;
+      auto op       = head[0] & 0x0f;
+      uint64_t size = head[1] & 0x7f;
+      if (size == 126) {
+        auto ext = take(2);
+        size     = (uint8_t) ext[0] << 8 | (uint8_t) ext[1];
+      } else if (size == 127) {
+        auto ext = take(8);
+        size     = 0;
+        for (auto c : ext) size = size << 8 | (uint8_t) c;
+      }
+      std::string mask = (head[1] & 0x80) ? take(4) : "";
+      auto payload     = take(size);
+      if (!mask.empty())
+        for (size_t i = 0; i < payload.size(); i++) payload[i] ^= mask[i & 3];
+      if (op == 8) throw std::runtime_error("connection closed by server");
+      if (op == 9 || op == 10) continue;
+      if (op != 0) opcode = op;
+      message += payload;
+      if (fin) return {opcode == 2, std::move(message)};
+    }
+  }
+};
+
+// JSON-RPC 2.0 on top of ws_client, binary frames that arrive early are kept until someone waits for them
+class rpc_client : public ws_client {
+  unsigned next_id = 0;
+  std::map<uint32_t, std::string> frames;
+
+  void pump(json *reply, unsigned id) {
+    auto [binary, message] = recv();
+    if (binary) {
+      if (message.size() < 4) return;
+      uint32_t nid;
+      std::memcpy(&nid, message.data(), sizeof nid);
+      frames[ntohl(nid)] += message.substr(4);
+      return;
+    }
+    auto parsed = json::parse(message);
+    if (reply && parsed.contains("id") && parsed["id"] == id) *reply = std::move(parsed);
+  }
+
+public:
+  using ws_client::ws_client;
+
+  json call(std::string const &method, json params) {
+    auto id = ++next_id;
+    send(json{{"jsonrpc", "2.0"}, {"method", method}, {"params", std::move(params)}, {"id", id}}.dump(), false);
+    json reply;
+    while (reply.is_null()) pump(&reply, id);
+    if (reply.contains("error")) throw std::runtime_error(method + ": " + reply["error"].dump());
+    return reply["result"];
+  }
+
+  std::string wait_frame(uint32_t id) {
+    auto it = frames.find(id);
+    while (it == frames.end()) {
+      pump(nullptr, 0);
+      it = frames.find(id);
+    }
+    auto data = std::move(it->second);
+    frames.erase(it);
+    return data;
+  }
+
+  void send_frame(uint32_t id, std::string_view data) {
+    uint32_t nid = htonl(id);
+    std::string frame{(char const *) &nid, sizeof nid};
+    frame += data;
+    send(frame, true);
+  }
+};
+
+static double micros(clock_type::duration d) { return std::chrono::duration<double, std::micro>(d).count(); }
+
+static json summarize(std::vector<double> samples) {
+  if (samples.empty()) return nullptr;
+  std::sort(samples.begin(), samples.end());
+  auto at = [&](double q) { return samples[std::min(samples.size() - 1, (size_t) (q * samples.size()))]; };
+  double sum = 0;
+  for (auto v : samples) sum += v;
+  return json{
+      {"count", samples.size()}, {"mean_us", sum / samples.size()}, {"p50_us", at(0.5)},
+      {"p99_us", at(0.99)},      {"p999_us", at(0.999)},            {"max_us", samples.back()},
+  };
+}
+
+static std::vector<double> collect(std::vector<std::vector<double>> &samples) {
+  std::vector<double> all;
+  for (auto &client : samples) {
+    all.insert(all.end(), client.begin(), client.end());
+    client.clear();
+  }
+  return all;
+}
+
+// Runs fn on every client concurrently and returns the wall time of the slowest
+template <typename Fn> static double run_clients(std::vector<std::unique_ptr<rpc_client>> &clients, Fn fn) {
+  std::vector<std::thread> threads;
+  std::atomic<bool> failed = false;
+  auto start               = clock_type::now();
+  for (size_t i = 0; i < clients.size(); i++)
+    threads.emplace_back([&, i] {
+      try {
+        fn(*clients[i], i);
+      } catch (std::exception const &ex) {
+        std::cerr << "client " << i << ": " << ex.what() << std::endl;
+        failed = true;
+      }
+    });
+  for (auto &thread : threads) thread.join();
+  if (failed) throw std::runtime_error("benchmark client failed");
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+static json run_suite(options const &opt, int port, SSL_CTX *ctx, fs::path const &dir) {
+  std::vector<std::unique_ptr<rpc_client>> clients;
+  for (unsigned i = 0; i < opt.clients; i++) clients.push_back(std::make_unique<rpc_client>(port, ctx));
+  std::vector<std::vector<double>> samples(opt.clients);
+  json result;
+
+  run_clients(clients, [&](rpc_client &client, size_t i) {
+    for (unsigned n = 0; n < opt.requests; n++) {
+      auto start = clock_type::now();
+      client.call("ping", json::array());
+      samples[i].push_back(micros(clock_type::now() - start));
+    }
+  });
+  result["ping"] = summarize(collect(samples));
+
+  std::string payload(blob_size, '\0');
+  std::mt19937 rng{42};
+  for (auto &c : payload) c = (char) rng();
+  auto total = (double) opt.clients * opt.blobs * blob_size / (1 << 20);
+
+  auto elapsed = run_clients(clients, [&](rpc_client &client, size_t i) {
+    auto path = (dir / ("blob-" + std::to_string(i))).string();
+    for (unsigned n = 0; n < opt.blobs; n++) {
+      uint32_t id = n + 1;
+      client.send_frame(id, payload);
+      client.call("fs.pwrite", {path, (size_t) n * blob_size, id});
+    }
+  });
+  result["fs.pwrite"] = {{"bytes", (size_t) (total * (1 << 20))}, {"seconds", elapsed}, {"mb_per_s", total / elapsed}};
+
+  elapsed = run_clients(clients, [&](rpc_client &client, size_t i) {
+    auto path = (dir / ("blob-" + std::to_string(i))).string();
+    for (unsigned n = 0; n < opt.blobs; n++) {
+      auto reply = client.call("fs.pread", {path, (size_t) n * blob_size, blob_size});
+      if (reply["blob"].is_null()) throw std::runtime_error("unexpected end of file");
+      if (client.wait_frame(reply["blob"].get<uint32_t>()).size() != blob_size) throw std::runtime_error("short read");
+    }
+  });
+  result["fs.pread"] = {{"bytes", (size_t) (total * (1 << 20))}, {"seconds", elapsed}, {"mb_per_s", total / elapsed}};
+
+  run_clients(clients, [&](rpc_client &client, size_t i) {
+    auto id = client.call("shell.open", {"cat", {"cat"}}).get<uint32_t>();
+    for (unsigned n = 0; n < opt.keys; n++) {
+      char key   = 'a' + n % 26;
+      auto start = clock_type::now();
+      client.send_frame(id | terminal_magic, {&key, 1});
+      // The pty echoes the keystroke before cat writes it back, the echo is what a user sees
+      while (client.wait_frame(id | terminal_magic).find(key) == std::string::npos) {}
+      samples[i].push_back(micros(clock_type::now() - start));
+    }
+    client.call("shell.close", {id});
+  });
+  result["shell.echo"] = summarize(collect(samples));
+  return result;
+}
+
+static int free_port() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in addr{};
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len        = sizeof addr;
+  bind(fd, (sockaddr *) &addr, len);
+  getsockname(fd, (sockaddr *) &addr, &len);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+static json bench_server(options const &opt, fs::path const &dir, bool tls) {
+  auto port = free_port();
+  {
+    std::ofstream config{dir / "bedweb.yaml"};
+    config << "listen: ws://127.0.0.1:" << port << "\n";
+    config << "threads: " << opt.threads << "\n";
+    config << "query_period: 60\n";
+    if (tls) config << "ssl:\n  cert: cert.pem\n  priv: priv.pem\n";
+  }
+  auto pid = fork();
+  if (pid == 0) {
+    chdir(dir.c_str());
+    execl(opt.server.c_str(), opt.server.c_str(), nullptr);
+    _exit(127);
+  }
+  SSL_CTX *ctx = nullptr;
+  if (tls) {
+    ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  }
+  json result;
+  try {
+    for (int retry = 0;; retry++) {
+      try {
+        rpc_client probe{port, ctx};
+        probe.call("ping", json::array());
+        break;
+      } catch (std::exception const &) {
+        if (retry == 100) throw std::runtime_error("server did not come up on port " + std::to_string(port));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    }
+    result = run_suite(opt, port, ctx, dir);
+  } catch (...) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    if (ctx) SSL_CTX_free(ctx);
+    throw;
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  if (ctx) SSL_CTX_free(ctx);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  options opt;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value      = [&] {
+      if (i + 1 == argc) throw std::invalid_argument("missing value for " + arg);
+      return std::string{argv[++i]};
+    };
+    if (arg == "--server")
+      opt.server = value();
+    else if (arg == "--output")
+      opt.output = value();
+    else if (arg == "--clients")
+      opt.clients = std::stoul(value());
+    else if (arg == "--requests")
+      opt.requests = std::stoul(value());
+    else if (arg == "--blobs")
+      opt.blobs = std::stoul(value());
+    else if (arg == "--keys")
+      opt.keys = std::stoul(value());
+    else if (arg == "--threads")
+      opt.threads = std::stoul(value());
+    else if (arg == "--plain-only")
+      opt.tls = false;
+    else if (arg == "--tls-only")
+      opt.plain = false;
+    else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--server PATH] [--output FILE] [--clients M] [--requests N] [--blobs N] [--keys N]"
+                   " [--threads N] [--plain-only | --tls-only]"
+                << std::endl;
+      return 1;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+  opt.server = fs::absolute(opt.server);
+  char tmpl[] = "/tmp/bedweb-bench-XXXXXX";
+  fs::path dir{mkdtemp(tmpl)};
+  int ret = 0;
+  try {
+    json report = {
+        {"clients", opt.clients}, {"threads", opt.threads}, {"requests", opt.requests},
+        {"blob_size", blob_size}, {"blobs", opt.blobs},     {"keys", opt.keys},
+    };
+    if (opt.plain) report["plain"] = bench_server(opt, dir, false);
+    if (opt.tls) {
+      auto cmd = "openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost -keyout '" +
+                 (dir / "priv.pem").string() + "' -out '" + (dir / "cert.pem").string() + "' 2>/dev/null";
+      if (std::system(cmd.c_str()) != 0) throw std::runtime_error("failed to generate a certificate with openssl");
+      report["tls"] = bench_server(opt, dir, true);
+    }
+    if (opt.output.empty())
+      std::cout << report.dump(2) << std::endl;
+    else
+      std::ofstream{opt.output} << report.dump(2) << std::endl;
+  } catch (std::exception const &ex) {
+    std::cerr << "bedweb-bench: " << ex.what() << std::endl;
+    ret = 1;
+  }
+  fs::remove_all(dir);
+  return ret;
+}
\ No newline at end of file
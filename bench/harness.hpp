@@ -0,0 +1,36 @@
+// Shared by the benchmarks: wall time and heap allocations of a piece of code. The global operator new is replaced to
+// count the allocations, so only one translation unit of a benchmark may include this.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+using clock_type = std::chrono::steady_clock;
+
+inline std::atomic<uint64_t> allocations{0}, allocated_bytes{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (auto ptr = std::malloc(size ?: 1)) return ptr;
+  throw std::bad_alloc{};
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+struct cost {
+  double seconds;
+  uint64_t allocations, bytes;
+};
+
+// Runs fn once
+template <typename F> inline cost measure(F &&fn) {
+  auto allocs = allocations.load(), bytes = allocated_bytes.load();
+  auto start  = clock_type::now();
+  fn();
+  return {std::chrono::duration<double>(clock_type::now() - start).count(), allocations.load() - allocs,
+          allocated_bytes.load() - bytes};
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+// Serializes a large directory listing the way fs.ls does, through the json DOM and through json_writer.
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <json.hpp>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/serializers.hpp"
+#include "harness.hpp"
+
+using json   = nlohmann::json;
+namespace fs = std::filesystem;
+
+struct sample {
+  cost spent;
+  std::string output;
+};
+
+template <typename F> static sample run(F &&fn) {
+  sample ret;
+  ret.spent = measure([&] { ret.output = fn(); });
+  return ret;
+}
+
+static json report_of(std::vector<sample> const &samples) {
+  auto best = samples.front().spent;
+  for (auto &s : samples)
+    if (s.spent.seconds < best.seconds) best = s.spent;
+  return {{"best_ms", best.seconds * 1e3}, {"allocations", best.allocations}, {"allocated_bytes", best.bytes}};
+}
+
+int main(int argc, char **argv) {
+  size_t entries  = 100000;
+  unsigned rounds = 5;
+  std::string dir;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--entries" && i + 1 < argc)
+      entries = std::stoul(argv[++i]);
+    else if (arg == "--rounds" && i + 1 < argc)
+      rounds = std::stoul(argv[++i]);
+    else if (arg == "--dir" && i + 1 < argc)
+      dir = argv[++i];
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--entries N] [--rounds N] [--dir EXISTING_DIR]" << std::endl;
+      return 1;
+    }
+  }
+  bool generated = dir.empty();
+  if (generated) {
+    char tmpl[] = "/tmp/bedweb-listing-XXXXXX";
+    dir         = mkdtemp(tmpl);
+    for (size_t i = 0; i < entries; i++) {
+      auto name = dir + "/entry-" + std::to_string(i) + (i % 10 == 0 ? ".d" : ".txt");
+      if (i % 10 == 0)
+        fs::create_directory(name);
+      else
+        close(open(name.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+  }
+  // Both paths list the same entries, the directory is read once up front
+  std::vector<fs::directory_entry> listing{fs::directory_iterator{dir}, fs::directory_iterator{}};
+
+  std::vector<sample> dom, writer;
+  std::string buffer;
+  for (unsigned round = 0; round < rounds; round++) {
+    dom.push_back(run([&] {
+      auto ret = json::array();
+      for (auto &entry : listing) ret.push_back(entry);
+      return ret.dump();
+    }));
+    writer.push_back(run([&] {
+      buffer.clear();
+      json_writer w{buffer};
+      w.begin_array();
+      for (auto &entry : listing) write_json(w, entry);
+      w.end_array();
+      return buffer;
+    }));
+  }
+  json report = {
+      {"entries", listing.size()},
+      {"output_bytes", writer.front().output.size()},
+      {"identical", dom.front().output == writer.front().output},
+      {"dom", report_of(dom)},
+      {"writer", report_of(writer)},
+  };
+  std::cout << report.dump(2) << std::endl;
+  if (generated) fs::remove_all(dir);
+  return report["identical"] ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,175 @@
+// Per-operation cost of the hot paths: ns/op and heap allocations/op (counted by replacing operator new).
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <json.hpp>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../src/binary_handler.hpp"
+#include "../src/serializers.hpp"
+#include "../src/sysinfo/cpuinfo.h"
+#include "../src/sysinfo/meminfo.h"
+#include "../src/terminal_manager.hpp"
+#include "harness.hpp"
+
+#ifndef BEDWEB_FIXTURES
+#  define BEDWEB_FIXTURES "bench/fixtures"
+#endif
+
+using json   = nlohmann::json;
+namespace fs = std::filesystem;
+
+template <typename T> static inline void keep(T const &value) { asm volatile("" : : "g"(&value) : "memory"); }
+
+struct result {
+  std::string name;
+  uint64_t iterations;
+  double ns, allocs, bytes;
+};
+
+struct options {
+  std::string filter, output;
+  double min_time = 0.25;
+};
+
+// Grows the iteration count until a run lasts min_time, the last run is reported
+static result repeat(std::string const &name, options const &opt, std::function<void()> const &op) {
+  op();
+  for (uint64_t iterations = 1;;) {
+    auto spent = measure([&] {
+      for (uint64_t i = 0; i < iterations; i++) op();
+    });
+    if (spent.seconds >= opt.min_time || iterations >= (1ull << 32))
+      return {name, iterations, spent.seconds * 1e9 / iterations, double(spent.allocations) / iterations,
+              double(spent.bytes) / iterations};
+    iterations = spent.seconds < opt.min_time / 100 ? iterations * 10
+                                                    : iterations * (opt.min_time / spent.seconds) * 1.2 + 1;
+  }
+}
+
+// Stands in for a websocket connection, frames are only counted
+struct null_client : rpc::server_io::client {
+  uint64_t frames = 0;
+  void send(std::string_view, rpc::message_type) override { frames++; }
+};
+
+int main(int argc, char **argv) {
+  options opt;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc)
+      opt.filter = argv[++i];
+    else if (arg == "--min-time" && i + 1 < argc)
+      opt.min_time = std::stod(argv[++i]);
+    else if (arg == "--output" && i + 1 < argc)
+      opt.output = argv[++i];
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--filter SUBSTRING] [--min-time SECONDS] [--output FILE]" << std::endl;
+      return 1;
+    }
+  }
+  std::vector<result> results;
+  auto bench = [&](std::string const &name, std::function<void()> const &op) {
+    if (name.find(opt.filter) == std::string::npos) return;
+    results.push_back(repeat(name, opt, op));
+    auto &res = results.back();
+    std::printf("%-40s %12llu %12.1f %10.2f %12.1f\n", res.name.c_str(), (unsigned long long) res.iterations, res.ns,
+                res.allocs, res.bytes);
+  };
+  std::printf("%-40s %12s %12s %10s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+
+  // sysinfo serializers
+  for (auto fixture : {"proc_stat_1cpu", "proc_stat_64cpu"}) {
+    auto path = std::string{BEDWEB_FIXTURES} + "/" + fixture;
+    if (!fs::exists(path)) {
+      std::cerr << "Missing fixture " << path << std::endl;
+      return 1;
+    }
+    sys::CPU cpu{path.c_str()};
+    bench(std::string{"proc/snapshot/"} + fixture, [&] { cpu.snapshot(); });
+    bench(std::string{"json/build_cpustat/"} + fixture, [&] { keep(build_cpustat(cpu).dump()); });
+    std::string buffer;
+    bench(std::string{"writer/cpustat/"} + fixture, [&] {
+      buffer.clear();
+      json_writer w{buffer};
+      write_cpustat(w, cpu);
+      keep(buffer);
+    });
+    if (std::string{fixture} == "proc_stat_1cpu")
+      bench("json/cpu_stat", [&] { keep(json(cpu.getGlobalStat())); });
+  }
+  struct sysinfo info = {};
+  sysinfo(&info);
+  bench("json/sysinfo", [&] { keep(json(info)); });
+
+  // directory entries, one entry per op over a synthetic directory
+  char tmpl[] = "/tmp/bedweb-microbench-XXXXXX";
+  fs::path dir{mkdtemp(tmpl)};
+  for (int i = 0; i < 256; i++) {
+    auto name = dir / ("entry-" + std::to_string(i));
+    if (i % 8 == 0)
+      fs::create_directory(name);
+    else
+      std::ofstream{name} << i;
+  }
+  std::vector<fs::directory_entry> entries{fs::directory_iterator{dir}, fs::directory_iterator{}};
+  size_t next = 0;
+  bench("json/directory_entry", [&] { keep(json(entries[next++ % entries.size()]).dump()); });
+  std::string listing;
+  bench("writer/directory_entry", [&] {
+    listing.clear();
+    json_writer w{listing};
+    write_json(w, entries[next++ % entries.size()]);
+    keep(listing);
+  });
+  fs::remove_all(dir);
+
+  // binary frames from the client: blob id decoding into the cache, then taken out by get()
+  auto handler = std::make_shared<binary_handler>();
+  auto client  = std::make_shared<null_client>();
+  std::string frame(4 + 4096, 'b');
+  uint32_t blob = 0;
+  bench("binary/on_binary+get", [&] {
+    uint32_t nid = htonl(++blob & 0x7fffffff);
+    std::memcpy(frame.data(), &nid, sizeof nid);
+    handler->on_binary(client, frame);
+    keep(handler->get(client, blob & 0x7fffffff));
+  });
+
+  // pty output: the framing read and on_data delivering to a linked client, a pipe stands in for the pty master
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) return 1;
+  fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+  handler->link_terminal(client, fds[0]);
+  static char shared_buffer[32767 + sizeof(terminal_manager::ID)];
+  std::string chunk(4096, 'o');
+  bench("terminal/read_frame+on_data", [&] {
+    if (write(fds[1], chunk.data(), chunk.size()) != (ssize_t) chunk.size()) std::abort();
+    auto len = terminal_manager::read_frame(fds[0], shared_buffer, sizeof shared_buffer);
+    handler->on_data(fds[0], {shared_buffer, (size_t) len});
+  });
+  handler->unlink_terminal(client, fds[0]);
+  close(fds[0]);
+  close(fds[1]);
+
+  if (!opt.output.empty()) {
+    auto report = json::array();
+    for (auto &res : results)
+      report.push_back({
+          {"name", res.name},
+          {"iterations", res.iterations},
+          {"ns_per_op", res.ns},
+          {"allocs_per_op", res.allocs},
+          {"bytes_per_op", res.bytes},
+      });
+    std::ofstream{opt.output} << report.dump(2) << std::endl;
+  }
+  return 0;
+}
\ No newline at end of file
@@ -10,164 +10,218 @@
 #include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <grp.h>
 #include <iostream>
 #include <json.hpp>
 #include <limits>
+#include <mutex>
 #include <pwd.h>
 #include <random>
 #include <rpc.hpp>
+#include <set>
 #include <stdexcept>
 #include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive.hpp"
+#include "mailbox.hpp"
+#include "recorder.hpp"
+#include "serializers.hpp"
+#include "stats.hpp"
 #include "syserror.hpp"
+#include "tail.hpp"
 #include "sysinfo/cpuinfo.h"
 #include "sysinfo/diskspace.h"
 #include "sysinfo/meminfo.h"
 #include "terminal_manager.hpp"
 #include "timer.hpp"
+#include "uring.hpp"
+#include "worker_pool.hpp"
 
 using namespace rpc;
 namespace fs                            = std::filesystem;
 constexpr inline auto max_binary_packet = 16384;
+// Set on the blob id of a pread whose read failed, such ids are drawn with the bit clear
+constexpr inline uint32_t read_failed = 1u << 30;
 
-inline static json build_cpustat(sys::CPU const &cpuinfo) {
-  return json({
-      {"global", cpuinfo.getGlobalStat()},
-      {"separated", cpuinfo.getStats()},
-      {"time", time(nullptr)},
-  });
+// Any object parameter with "blob": true asks for the result as a JSON text blob instead of an inline value
+static bool wants_blob(json const &params) {
+  if (!params.is_array()) return false;
+  for (auto &param : params)
+    if (param.is_object() && param.value("blob", false)) return true;
+  return false;
 }
 
-// Fix this for gcc 9.2.0
-struct hack_clock : fs::file_time_type::clock {
-  template <typename TargetDur, typename _Dur>
-  static std::chrono::time_point<fs::file_time_type::clock, TargetDur>
-  from_sys(const std::chrono::time_point<std::chrono::system_clock, _Dur> &__t) noexcept {
-    return std::chrono::time_point_cast<TargetDur>(_S_from_sys(__t));
-  }
+using handler_t = std::function<json(std::shared_ptr<server_io::client>, json)>;
 
-  template <typename TargetDur, typename _Dur>
-  static std::chrono::time_point<std::chrono::system_clock, TargetDur>
-  to_sys(const std::chrono::time_point<fs::file_time_type::clock, _Dur> &__t) noexcept {
-    return std::chrono::time_point_cast<TargetDur>(_S_to_sys(__t));
-  }
+// Reads /proc once per period for the whole process
+struct sampler {
+  // The reactor a server belongs to, null when there is a single loop without a mailbox
+  using target = std::pair<mailbox *, RPC *>;
+  std::mutex mtx;
+  sys::CPU cpuinfo;
+  std::vector<target> servers;
 };
 
-namespace nlohmann {
-template <typename T> struct adl_serializer<std::optional<T>> {
-  inline static void to_json(rpc::json &j, const std::optional<T> &opt) {
-    if (opt.has_value())
-      ::to_json(j, opt.value());
-    else
-      j = nullptr;
-  }
-};
-template <> struct adl_serializer<fs::file_type> {
-  inline static void to_json(rpc::json &j, const fs::file_type &type) {
-#define detect(name) type == fs::file_type::name ? #name:
-    j = detect(block) detect(character) detect(directory) detect(fifo) detect(regular) detect(socket)
-        detect(symlink) "unknown";
-#undef detect
-  }
-};
-template <> struct adl_serializer<fs::directory_entry> {
-  inline static void to_json(rpc::json &j, const fs::directory_entry &entry) {
-    j = json::object({
-        {"name", entry.path().filename().c_str()},
-        {"type", entry.status().type()},
-        {"perm", entry.status().permissions()},
-        {"link", entry.hard_link_count()},
-        {"time", (unsigned long) hack_clock::to_sys<std::chrono::milliseconds>(entry.last_write_time())
-                     .time_since_epoch()
-                     .count()},
-    });
-  }
+// Filesystem queries that touch no server state, a batch may run them on worker threads
+static std::set<std::string> const concurrent_methods{
+    "fs.exists", "fs.stat", "fs.lstat", "fs.realpath", "fs.ls", "fs.tree",
 };
+constexpr inline size_t batch_parallel_min = 8;
+constexpr inline size_t batch_workers      = 4;
 
-template <> struct adl_serializer<fs::file_status> {
-  inline static void to_json(rpc::json &j, const fs::file_status &status) {
-    j = json::object({
-        {"type", status.type()},
-        {"perm", status.permissions()},
-    });
-  }
-};
-template <> struct adl_serializer<passwd> {
-  inline static void to_json(rpc::json &j, const passwd &pd) {
-    j = json::object({
-        {"uid", pd.pw_uid},
-        {"gid", pd.pw_gid},
-        {"username", pd.pw_name},
-        {"realneme", pd.pw_gecos},
-        {"home", pd.pw_dir},
-        {"shell", pd.pw_shell},
-    });
-  }
-};
-template <> struct adl_serializer<group> {
-  inline static void to_json(rpc::json &j, const group &grp) {
-    auto members = rpc::json::array();
-    auto it      = grp.gr_mem;
-    while (*it) {
-      members.push_back(*it);
-      it++;
-    }
-    j = json::object({
-        {"gid", grp.gr_gid},
-        {"name", grp.gr_name},
-        {"members", members},
-    });
-  }
-};
-} // namespace nlohmann
+static json invoke(handler_t const &fn, std::shared_ptr<server_io::client> const &client, json params) {
+  try {
+    return json::object({{"result", fn(client, std::move(params))}});
+  } catch (std::exception const &ex) { return json::object({{"error", ex.what()}}); }
+}
 
 uint32_t gen_blob_id(bool terminal = false) {
-  static std::random_device rd;
-  static std::default_random_engine e{rd()};
-  static std::uniform_int_distribution<uint32_t> dist(
+  static thread_local std::random_device rd;
+  static thread_local std::default_random_engine e{rd()};
+  static thread_local std::uniform_int_distribution<uint32_t> dist(
       std::numeric_limits<uint32_t>::min(), std::numeric_limits<uint32_t>::max() >> 1);
   return dist(e);
 }
 
+// Serializes straight into a buffer reused by the reactor, behind a blob frame header, so no json DOM is built.
+// Must run on the client's reactor (a batch never moves blob calls to its workers).
+template <typename F>
+static json send_serialized(binary_handler &binhandler, std::shared_ptr<server_io::client> const &client, F &&fill) {
+  static thread_local std::string buffer;
+  constexpr size_t keep_capacity = 1 << 20;
+  buffer.assign(sizeof(uint32_t), '\0');
+  json_writer writer{buffer};
+  fill(writer);
+  auto id      = gen_blob_id();
+  uint32_t nid = htonl(id);
+  memcpy(buffer.data(), &nid, sizeof nid);
+  binhandler.send(client, buffer);
+  auto size = buffer.size() - sizeof nid;
+  if (buffer.capacity() > keep_capacity) std::string{}.swap(buffer);
+  return json::object({{"blob", id}, {"size", size}});
+}
+
 void prepare(
     RPC &server, std::shared_ptr<binary_handler> binhandler, std::shared_ptr<epoll> ep, api_config const &config) {
-  server.reg("ping", [](auto client, json input) -> json { return "pong"; });
+  auto &stats = server_stats::global();
+  static thread_local std::map<std::string, handler_t> methods;
+  auto reg = [&](std::string const &name, handler_t fn) {
+    fn = [&latency = stats.method(name), fn = std::move(fn)](auto client, json input) -> json {
+      latency_histogram::scope timing{latency};
+      return fn(std::move(client), std::move(input));
+    };
+    methods[name] = fn;
+    server.reg(name, std::move(fn));
+  };
+
+  // Started with the first reactor, before it blocks SIGCHLD, so the workers block every signal themselves
+  static worker_pool workers{batch_workers};
+  // [[method, params], ...] -> [{"result": ...} or {"error": ...}, ...] in call order, in a single round trip
+  reg("batch", [&](std::shared_ptr<server_io::client> client, json input) -> json {
+    auto &calls = input[0];
+    if (!calls.is_array()) throw std::invalid_argument("calls");
+    std::vector<json> results(calls.size());
+    // Bound here, workers would otherwise see their own empty thread_local table
+    auto &table = methods;
+    auto run    = [&](size_t i) {
+      auto &call = calls[i];
+      if (!call.is_array() || call.empty() || !call[0].is_string()) {
+        results[i] = json::object({{"error", "malformed call"}});
+        return;
+      }
+      auto name = call[0].get<std::string>();
+      auto it   = table.find(name);
+      if (it == table.end() || name == "batch")
+        results[i] = json::object({{"error", "method not found: " + name}});
+      else
+        results[i] = invoke(it->second, client, call.size() > 1 ? call[1] : json::array());
+    };
+    auto concurrent = [&](size_t i) {
+      auto &call = calls[i];
+      return call.is_array() && !call.empty() && call[0].is_string() &&
+             concurrent_methods.count(call[0].get<std::string>()) && !(call.size() > 1 && wants_blob(call[1]));
+    };
+    // Consecutive independent queries are spread over worker threads, everything else keeps its order
+    for (size_t i = 0; i < calls.size();) {
+      auto end = i;
+      while (end < calls.size() && concurrent(end)) end++;
+      if (end - i < batch_parallel_min) {
+        run(i++);
+        continue;
+      }
+      workers.run(end - i, [&, begin = i](size_t j) { run(begin + j); });
+      i = end;
+    }
+    return results;
+  });
 
-  static sys::CPU cpuinfo{};
+  reg("ping", [](auto client, json input) -> json { return "pong"; });
+
+  // One sampler per process reads /proc, on the first reactor to get here, and every reactor emits its samples to its
+  // own clients
+  static sampler samples;
+  {
+    std::lock_guard lock{samples.mtx};
+    samples.servers.push_back({mailbox::current, &server});
+  }
   server.event("sysinfo.cpustat");
-  server.reg("sysinfo.cpuid", [&](auto client, json input) -> json { return cpuinfo.getCPUID(); });
-  server.reg("sysinfo.cpustat", [&](auto client, json input) -> json { return build_cpustat(cpuinfo); });
+  reg("sysinfo.cpuid", [&](auto client, json input) -> json {
+    std::lock_guard lock{samples.mtx};
+    return samples.cpuinfo.getCPUID();
+  });
+  reg("sysinfo.cpustat", [&, binhandler](auto client, json input) -> json {
+    std::lock_guard lock{samples.mtx};
+    if (wants_blob(input))
+      return send_serialized(*binhandler, client, [&](json_writer &w) { write_cpustat(w, samples.cpuinfo); });
+    return build_cpustat(samples.cpuinfo);
+  });
 
   server.event("sysinfo.sysinfo");
-  server.reg("sysinfo.sysinfo", [&](auto client, json input) -> json { return sys::getsysinfo(); });
+  reg("sysinfo.sysinfo", [&](auto client, json input) -> json { return sys::getsysinfo(); });
 
   server.event("sysinfo.diskspace");
-  server.reg("sysinfo.diskspace", [&](auto client, json input) -> json {
+  reg("sysinfo.diskspace", [&](auto client, json input) -> json {
     auto path = (input.size() == 1 && input[0].is_string()) ? input[0].get<std::string>() : config.monitor_path;
     return sys::getDiskSize(path);
   });
 
-  server.reg("sysinfo.users", [&](auto client, json input) -> json {
+  reg("sysinfo.users", [&, binhandler](auto client, json input) -> json {
     passwd *pd;
+    if (wants_blob(input))
+      return send_serialized(*binhandler, client, [&](json_writer &w) {
+        w.begin_array();
+        setpwent();
+        while ((pd = getpwent())) write_json(w, *pd);
+        endpwent();
+        w.end_array();
+      });
     auto ret = json::array();
     setpwent();
     while ((pd = getpwent())) ret.push_back(*pd);
     endpwent();
     return ret;
   });
-  server.reg("sysinfo.groups", [&](auto client, json input) -> json {
+  reg("sysinfo.groups", [&, binhandler](auto client, json input) -> json {
     group *grp;
+    if (wants_blob(input))
+      return send_serialized(*binhandler, client, [&](json_writer &w) {
+        w.begin_array();
+        setgrent();
+        while ((grp = getgrent())) write_json(w, *grp);
+        endgrent();
+        w.end_array();
+      });
     auto ret = json::array();
     setgrent();
     while ((grp = getgrent())) ret.push_back(*grp);
     endgrent();
     return ret;
   });
-  server.reg("sysinfo.current_user", [&](auto client, json input) -> json {
+  reg("sysinfo.current_user", [&](auto client, json input) -> json {
     gid_t list[getgroups(0, nullptr)];
     getgroups(sizeof(list) / sizeof(list[0]), list);
     auto groups = json::array();
@@ -182,53 +236,152 @@ void prepare(
   });
 
   auto callback = [&] {
-    cpuinfo.snapshot();
-    server.emit("sysinfo.cpustat", build_cpustat(cpuinfo));
-    server.emit("sysinfo.sysinfo", sys::getsysinfo());
-    server.emit("sysinfo.diskspace", {{"path", config.monitor_path}, {"info", sys::getDiskSize(config.monitor_path)}});
+    json cpustat;
+    std::vector<sampler::target> targets;
+    {
+      std::lock_guard lock{samples.mtx};
+      samples.cpuinfo.snapshot();
+      cpustat = build_cpustat(samples.cpuinfo);
+      targets = samples.servers;
+    }
+    json info = sys::getsysinfo();
+    json disk = {{"path", config.monitor_path}, {"info", sys::getDiskSize(config.monitor_path)}};
+    for (auto [box, target] : targets) {
+      auto emit = [=] {
+        target->emit("sysinfo.cpustat", cpustat);
+        target->emit("sysinfo.sysinfo", info);
+        target->emit("sysinfo.diskspace", disk);
+      };
+      if (box)
+        box->dispatch(std::move(emit));
+      else
+        emit();
+    }
   };
   static auto timer = Timer{config.period ?: 1, ep, callback};
 
-  server.reg("fs.ls", [&](auto client, json input) -> json {
+  reg("fs.ls", [&, binhandler](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
-    auto ret  = json::array();
+    if (wants_blob(input))
+      return send_serialized(*binhandler, client, [&](json_writer &w) {
+        w.begin_array();
+        for (const auto &entry : fs::directory_iterator{path, fs::directory_options::skip_permission_denied})
+          write_json(w, entry);
+        w.end_array();
+      });
+    auto ret = json::array();
     for (const auto &entry : fs::directory_iterator{path, fs::directory_options::skip_permission_denied})
       ret.push_back(entry);
     return ret;
   });
-  server.reg("fs.tree", [&](auto client, json input) -> json {
+  reg("fs.tree", [&, binhandler](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
-    auto ret  = json::array();
+    if (wants_blob(input))
+      return send_serialized(*binhandler, client, [&](json_writer &w) {
+        w.begin_array();
+        for (const auto &entry : fs::recursive_directory_iterator{path, fs::directory_options::skip_permission_denied})
+          write_json(w, entry);
+        w.end_array();
+      });
+    auto ret = json::array();
     for (const auto &entry : fs::recursive_directory_iterator{path, fs::directory_options::skip_permission_denied})
       ret.push_back(entry);
     return ret;
   });
-  server.reg("fs.pread", [&](std::shared_ptr<server_io::client> client, json input) -> json {
+  // Blocking preads remain the fallback when io_uring is unavailable or all of its buffers are in flight
+  static thread_local auto ring = config.io_uring ? uring::create(ep) : std::unique_ptr<uring>{};
+  reg("fs.pread", [&, binhandler](std::shared_ptr<server_io::client> client, json input) -> json {
     auto path   = input[0].get<std::string>();
     auto offset = input[1].get<size_t>();
     auto size   = input[2].get<size_t>();
     if (size > max_binary_packet || size == 0) throw std::length_error("size");
-    int file = open(path.c_str(), 0);
-    static char shared_buffer[max_binary_packet + 4];
-    auto ret = pread(file, shared_buffer + 4, size, offset);
-    if (ret == -1) throw syserror("pread");
-    if (ret == 0) return json::object({{"blob", nullptr}});
-    auto id = gen_blob_id();
-    memcpy(shared_buffer, &id, sizeof id);
-    client->send({shared_buffer, size + 4}, message_type::BINARY);
-    return json::object({{"blob", ntohs(id)}});
+    int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1) throw syserror("open");
+    // Only regular files have a meaningful size, procfs/sysfs entries and devices report 0 or garbage
+    if (struct stat st; fstat(file, &st) == 0 && S_ISREG(st.st_mode) && (off_t) offset >= st.st_size) {
+      close(file);
+      return json::object({{"blob", nullptr}});
+    }
+    // Both paths reply with the blob id first and queue its frame as bulk behind the reply: what was read, an empty
+    // frame at the end of the file, or {"error": ...} on the id with `read_failed` set when the read failed
+    auto id   = gen_blob_id() & ~read_failed;
+    auto done = [id, binhandler, weak = std::weak_ptr{client}](int res, char *data, size_t len) {
+      auto client = weak.lock();
+      if (!client) return;
+      if (res < 0) {
+        uint32_t nid = htonl(id | read_failed);
+        std::string frame{(char const *) &nid, sizeof nid};
+        frame += json::object({{"error", strerror(-res)}}).dump();
+        binhandler->send(client, frame, binary_handler::priority::bulk);
+        return;
+      }
+      uint32_t nid = htonl(id);
+      memcpy(data, &nid, sizeof nid);
+      binhandler->send(client, {data, len}, binary_handler::priority::bulk);
+    };
+    if (ring && ring->read(file, size, offset, done)) return json::object({{"blob", id}});
+    static thread_local char shared_buffer[max_binary_packet + uring::headroom];
+    auto ret = pread(file, shared_buffer + uring::headroom, size, offset);
+    auto err = errno;
+    close(file);
+    done(ret == -1 ? -err : ret, shared_buffer, uring::headroom + (ret > 0 ? ret : 0));
+    return json::object({{"blob", id}});
   });
-  server.reg("fs.pwrite", [&, binhandler](std::shared_ptr<server_io::client> client, json input) -> json {
+  reg("fs.pwrite", [&, binhandler](std::shared_ptr<server_io::client> client, json input) -> json {
     auto path   = input[0].get<std::string>();
     auto offset = input[1].get<size_t>();
     auto blob   = input[2].get<uint32_t>();
     auto data   = binhandler->get(client, blob);
-    int file    = open(path.c_str(), 0);
-    auto ret    = pwrite(file, data.c_str(), data.size(), offset);
+    int file    = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (file == -1) throw syserror("open");
+    auto ret = pwrite(file, data.c_str(), data.size(), offset);
+    close(file);
     if (ret == -1) throw syserror("pwrite");
     return ret;
   });
-  server.reg("fs.copy", [&](auto client, json input) -> json {
+  reg("fs.archive", [&, binhandler](auto client, json input) -> json {
+    auto path       = input[0].get<std::string>();
+    bool gzip       = false;
+    unsigned window = 8;
+    if (input.size() == 2) {
+      auto &opt = input[1];
+      gzip      = opt.value("gzip", false);
+      window    = opt.value("window", window);
+    }
+    auto id = gen_blob_id();
+    binhandler->open_archive(client, id, std::make_unique<tar_writer>(path, gzip), window ?: 1);
+    return json::object({{"stream", id}});
+  });
+  reg("fs.archive_ack", [&, binhandler](auto client, json input) -> json {
+    auto id    = input[0].get<uint32_t>();
+    auto count = input[1].get<unsigned>();
+    binhandler->ack_archive(client, id, count);
+    return nullptr;
+  });
+  reg("fs.archive_cancel", [&, binhandler](auto client, json input) -> json {
+    auto id = input[0].get<uint32_t>();
+    binhandler->close_archive(client, id);
+    return nullptr;
+  });
+  reg("fs.unarchive", [&, binhandler](auto client, json input) -> json {
+    auto path = input[0].get<std::string>();
+    bool gzip = input.size() == 2 && input[1].value("gzip", false);
+    auto id   = gen_blob_id();
+    binhandler->open_unarchive(client, id, std::make_unique<tar_reader>(path, gzip));
+    return json::object({{"stream", id}});
+  });
+  reg("fs.unarchive_write", [&, binhandler](auto client, json input) -> json {
+    auto id   = input[0].get<uint32_t>();
+    auto blob = input[1].get<uint32_t>();
+    auto data = binhandler->get(client, blob);
+    return binhandler->feed_unarchive(client, id, data);
+  });
+  reg("fs.unarchive_close", [&, binhandler](auto client, json input) -> json {
+    auto id = input[0].get<uint32_t>();
+    binhandler->close_unarchive(client, id);
+    return nullptr;
+  });
+  reg("fs.copy", [&](auto client, json input) -> json {
     auto path   = input[0].get<std::string>();
     auto target = input[1].get<std::string>();
     fs::copy_options options;
@@ -247,89 +400,157 @@ void prepare(
     fs::copy(target, path, options);
     return nullptr;
   });
-  server.reg("fs.symlink", [&](auto client, json input) -> json {
+  reg("fs.symlink", [&](auto client, json input) -> json {
     auto path   = input[0].get<std::string>();
     auto target = input[1].get<std::string>();
     fs::create_symlink(target, path);
     return nullptr;
   });
-  server.reg("fs.hardlink", [&](auto client, json input) -> json {
+  reg("fs.hardlink", [&](auto client, json input) -> json {
     auto path   = input[0].get<std::string>();
     auto target = input[1].get<std::string>();
     fs::create_hard_link(target, path);
     return nullptr;
   });
-  server.reg("fs.mkdir", [&](auto client, json input) -> json {
+  reg("fs.mkdir", [&](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
     return fs::create_directories(path);
   });
-  server.reg("fs.realpath", [&](auto client, json input) -> json {
+  reg("fs.realpath", [&](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
     return fs::canonical(path);
   });
-  server.reg("fs.resize", [&](auto client, json input) -> json {
+  reg("fs.resize", [&](auto client, json input) -> json {
     auto path     = input[0].get<std::string>();
     auto new_size = input[0].get<std::uintmax_t>();
     fs::resize_file(path, new_size);
     return nullptr;
   });
-  server.reg("fs.remove", [&](auto client, json input) -> json {
+  reg("fs.remove", [&](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
     return fs::remove_all(path);
   });
-  server.reg("fs.exists", [&](auto client, json input) -> json {
+  reg("fs.exists", [&](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
     return fs::exists(path);
   });
-  server.reg("fs.stat", [&](auto client, json input) -> json {
+  reg("fs.stat", [&](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
     return fs::status(path);
   });
-  server.reg("fs.lstat", [&](auto client, json input) -> json {
+  reg("fs.lstat", [&](auto client, json input) -> json {
     auto path = input[0].get<std::string>();
     return fs::symlink_status(path);
   });
 
-  static terminal_manager termmgr{binhandler, ep};
-  server.reg("shell.open_shell", [&, binhandler](auto client, json input) -> json {
+  static thread_local tail_manager tails{binhandler, ep};
+  // [path, {"offset": n} or {"lines": n}] (default: the last 10 lines), the reply tells where the stream starts
+  reg("fs.tail", [&](std::shared_ptr<server_io::client> client, json input) -> json {
+    auto path    = input[0].get<std::string>();
+    auto options = input.size() > 1 && input[1].is_object() ? input[1] : json::object();
+    off_t offset = options.value("offset", (off_t) 0);
+    long lines   = options.contains("offset") ? options.value("lines", -1l) : options.value("lines", 10l);
+    if (offset < 0) throw std::invalid_argument("offset");
+    if (options.contains("lines") && lines < 0) throw std::invalid_argument("lines");
+    auto id  = gen_blob_id();
+    auto pos = tails.follow(client, id, path, offset, lines);
+    return json::object({{"id", id}, {"offset", pos.offset}, {"size", pos.size}});
+  });
+  reg("fs.tail_cancel", [&](std::shared_ptr<server_io::client> client, json input) -> json {
+    tails.cancel(client, input[0].get<uint32_t>());
+    return nullptr;
+  });
+
+  // One per process since SIGCHLD is, it polls terminals on the first reactor to get here
+  static terminal_manager termmgr{binhandler, ep, config.spawn};
+  reg("shell.open_shell", [&, binhandler](auto client, json input) -> json {
     auto shell = getenv("SHELL");
     if (!shell) throw std::runtime_error("no SHELL env");
-    auto id = termmgr.alloc_terminal(shell, {"-l"});
-    binhandler->link_terminal(client, id);
-    return id;
+    return termmgr.alloc_terminal(shell, {"-l"}, [&](auto id) { binhandler->link_terminal(client, id); });
   });
-  server.reg("shell.open", [&, binhandler](auto client, json input) -> json {
+  reg("shell.open", [&, binhandler](auto client, json input) -> json {
     auto program = input[0].get<std::string>();
     auto args    = input[1].get<std::vector<std::string>>();
-    auto id      = termmgr.alloc_terminal(program, args);
-    binhandler->link_terminal(client, id);
-    return id;
+    return termmgr.alloc_terminal(program, args, [&](auto id) { binhandler->link_terminal(client, id); });
   });
-  server.reg("shell.open_id", [&, binhandler](auto client, json input) -> json {
+  reg("shell.open_id", [&, binhandler](auto client, json input) -> json {
     auto id = input[0].get<terminal_manager::ID>();
     binhandler->link_orphan_terminal(client, id);
     return id;
   });
-  server.reg("shell.get_orphan_list", [&, binhandler](auto client, json input) -> json {
+  reg("shell.get_orphan_list", [&, binhandler](auto client, json input) -> json {
     return binhandler->get_orphan_terminal();
   });
-  server.reg("shell.resize", [&, binhandler](auto client, json input) -> json {
+  reg("shell.resize", [&, binhandler](auto client, json input) -> json {
     auto id  = input[0].get<std::uint32_t>();
     auto row = input[1].get<std::uint16_t>();
     auto col = input[2].get<std::uint16_t>();
     if (binhandler->check_terminal_link(client, id)) termmgr.resize_terminal(id, {row, col});
     return nullptr;
   });
-  server.reg("shell.unlink", [&, binhandler](auto client, json input) -> json {
+  reg("shell.window", [&, binhandler](auto client, json input) -> json {
+    auto id     = input[0].get<binary_handler::term_id>();
+    auto window = input[1].get<size_t>();
+    binhandler->set_terminal_window(client, id, window);
+    return nullptr;
+  });
+  reg("shell.ack", [&, binhandler](auto client, json input) -> json {
+    auto id    = input[0].get<binary_handler::term_id>();
+    auto bytes = input[1].get<size_t>();
+    binhandler->ack_terminal(client, id, bytes);
+    return nullptr;
+  });
+  reg("shell.unlink", [&, binhandler](auto client, json input) -> json {
     auto id = input[0].get<binary_handler::term_id>();
     binhandler->unlink_terminal(client, id);
     return nullptr;
   });
-  server.reg("shell.close", [&, binhandler](auto client, json input) -> json {
+  reg("shell.close", [&, binhandler](auto client, json input) -> json {
     auto id = input[0].get<binary_handler::term_id>();
     if (binhandler->check_terminal_link(client, id)) termmgr.close_terminal(id);
     return nullptr;
   });
+  reg("shell.recordings", [&](auto client, json input) -> json {
+    if (config.record_path.empty()) throw std::invalid_argument("session recording is disabled");
+    return session_recorder::list(config.record_path);
+  });
+  reg("shell.replay", [&](auto client, json input) -> json {
+    if (config.record_path.empty()) throw std::invalid_argument("session recording is disabled");
+    auto name  = input[0].get<std::string>();
+    auto from  = input.size() > 1 ? input[1].get<double>() : 0.0;
+    auto limit = input.size() > 2 ? input[2].get<size_t>() : 1024;
+    return session_recorder::replay(config.record_path, name, from, limit);
+  });
+
+  auto build_stats = [binhandler] {
+    auto usage   = binhandler->usage();
+    auto clients = json::array();
+    for (auto &traffic : usage.clients)
+      clients.push_back(json::object(
+          {{"bytes_sent", traffic.bytes}, {"frames_sent", traffic.frames}, {"queued_bytes", traffic.queued}}));
+    auto ret = json::object({
+        {"methods", server_stats::global().methods_json()},
+        {"loop_lag", server_stats::global().loop_lag.to_json()},
+        {"clients", clients},
+        {"bincache", {{"blobs", usage.blobs}, {"bytes", usage.blob_bytes}}},
+        {"terminals", {{"live", termmgr.count()}, {"orphan", usage.orphans}}},
+        {"time", time(nullptr)},
+    });
+    if (auto &recorder = binhandler->recorder)
+      ret["recorder"] = {{"queued_bytes", recorder->queued()}, {"dropped", recorder->dropped()}};
+    return ret;
+  };
+  server.event("server.stats");
+  reg("server.stats", [=](std::shared_ptr<server_io::client> client, json input) -> json {
+    auto ret    = build_stats();
+    auto own    = binhandler->traffic_of(client);
+    ret["self"] = {{"bytes_sent", own.bytes}, {"frames_sent", own.frames}, {"queued_bytes", own.queued}};
+    return ret;
+  });
+  if (config.stats_event) {
+    auto emit_stats = [&server, build_stats] { server.emit("server.stats", build_stats()); };
+    static thread_local auto stats_timer = Timer{config.period ?: 1, ep, emit_stats};
+  }
 
   std::cerr << "init finished" << std::endl;
 }
\ No newline at end of file
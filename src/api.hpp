@@ -8,6 +8,10 @@
 struct api_config {
   unsigned period;
   std::string monitor_path;
+  bool io_uring;
+  bool stats_event;
+  std::string record_path;
+  std::shared_ptr<spawner> spawn;
 };
 
 void prepare(
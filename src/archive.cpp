@@ -0,0 +1,359 @@
+#include "archive.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "syserror.hpp"
+
+namespace fs = std::filesystem;
+
+static constexpr size_t block_size = 512;
+
+struct scoped_fd {
+  int fd;
+  ~scoped_fd() {
+    if (fd != -1) close(fd);
+  }
+};
+
+// Numbers that do not fit in the octal field fall back to the GNU base-256 encoding
+static void put_number(char *field, size_t width, uintmax_t value) {
+  if (value >> (3 * (width - 1))) {
+    field[0] = '\x80';
+    for (size_t i = width - 1; i > 0; i--, value >>= 8) field[i] = value & 0xff;
+  } else
+    snprintf(field, width, "%0*jo", (int) width - 1, value);
+}
+
+static uintmax_t parse_number(char const *field, size_t width) {
+  uintmax_t value = 0;
+  if ((unsigned char) field[0] & 0x80) {
+    for (size_t i = 1; i < width; i++) value = value << 8 | (unsigned char) field[i];
+    return value;
+  }
+  size_t i = 0;
+  while (i < width && field[i] == ' ') i++;
+  for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) value = value * 8 + (field[i] - '0');
+  return value;
+}
+
+static unsigned checksum(char const *header) {
+  unsigned sum = 0;
+  for (size_t i = 0; i < block_size; i++) sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) header[i];
+  return sum;
+}
+
+static std::string
+make_header(std::string_view name, std::string_view link, char type, uintmax_t size, struct stat const &st) {
+  std::string block(block_size, '\0');
+  auto header = block.data();
+  name.copy(header, 100);
+  put_number(header + 100, 8, st.st_mode & 07777);
+  put_number(header + 108, 8, st.st_uid);
+  put_number(header + 116, 8, st.st_gid);
+  put_number(header + 124, 12, size);
+  put_number(header + 136, 12, st.st_mtime);
+  header[156] = type;
+  link.copy(header + 157, 100);
+  std::memcpy(header + 257, "ustar  ", 8);
+  snprintf(header + 148, 8, "%06o", checksum(header));
+  return block;
+}
+
+static void append_long(std::string &out, char type, std::string const &value) {
+  struct stat st = {};
+  out += make_header("././@LongLink", {}, type, value.size() + 1, st);
+  out += value;
+  out.append(block_size - value.size() % block_size, '\0');
+}
+
+tar_writer::tar_writer(fs::path root, bool gzip)
+    : root(std::move(root)), it(this->root, fs::directory_options::skip_permission_denied), gzip(gzip) {
+  if (gzip) {
+    zs = {};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("deflateInit");
+  }
+}
+
+tar_writer::~tar_writer() {
+  if (file != -1) close(file);
+  if (gzip) deflateEnd(&zs);
+}
+
+static void skipped(fs::path const &path, char const *what) {
+  std::cerr << "Skipped " << path << " in archive, " << what << ": " << strerror(errno) << std::endl;
+}
+
+// An entry that vanished or cannot be read is left out on its own, the rest of the archive goes on
+void tar_writer::emit_header(fs::directory_entry const &entry) {
+  struct stat st;
+  if (lstat(entry.path().c_str(), &st) != 0) return skipped(entry.path(), "lstat");
+  auto name = entry.path().lexically_relative(root).generic_string();
+  std::string link;
+  char type;
+  uintmax_t size = 0;
+  if (S_ISREG(st.st_mode)) {
+    file = open(entry.path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (file == -1) return skipped(entry.path(), "open");
+    type = '0';
+    size = st.st_size;
+  } else if (S_ISDIR(st.st_mode)) {
+    type = '5';
+    name += '/';
+  } else if (S_ISLNK(st.st_mode)) {
+    std::error_code ec;
+    link = fs::read_symlink(entry.path(), ec);
+    if (ec) {
+      errno = ec.value();
+      return skipped(entry.path(), "readlink");
+    }
+    type = '2';
+  } else
+    return;
+  if (name.size() > 100) append_long(pending, 'L', name);
+  if (link.size() > 100) append_long(pending, 'K', link);
+  pending += make_header(name, link, type, size, st);
+  remain  = size;
+  padding = (block_size - size % block_size) % block_size;
+}
+
+bool tar_writer::fill(std::string &out, size_t limit) {
+  auto target = out.size() + limit;
+  while (out.size() < target) {
+    if (!pending.empty()) {
+      auto len = std::min(pending.size(), target - out.size());
+      out.append(pending, 0, len);
+      pending.erase(0, len);
+    } else if (file != -1) {
+      if (remain == 0) {
+        close(file);
+        file = -1;
+        pending.assign(padding, '\0');
+        continue;
+      }
+      auto pos = out.size();
+      auto len = (size_t) std::min<uintmax_t>(remain, target - pos);
+      out.resize(pos + len);
+      auto ret = read(file, out.data() + pos, len);
+      // The file shrank after its header went out, keep the archive consistent by zero filling
+      if (ret <= 0)
+        std::memset(out.data() + pos, 0, len);
+      else
+        out.resize(pos + (len = ret));
+      remain -= len;
+    } else if (finished) {
+      return false;
+    } else {
+      if (started) {
+        // A failed step leaves the iterator at its end, ending the archive there would pass for a complete one
+        auto current = it->path();
+        std::error_code ec;
+        it.increment(ec);
+        if (ec) throw fs::filesystem_error("archive", current, ec);
+      }
+      started = true;
+      if (it == fs::recursive_directory_iterator{}) {
+        finished = true;
+        pending.assign(block_size * 2, '\0');
+      } else
+        emit_header(*it);
+    }
+  }
+  return !(finished && pending.empty());
+}
+
+bool tar_writer::next(std::string &out, size_t limit) {
+  if (!gzip) return fill(out, limit);
+  auto target = out.size() + limit;
+  while (out.size() < target) {
+    if (raw_pos == raw.size() && !raw_eof) {
+      raw.clear();
+      raw_pos = 0;
+      raw_eof = !fill(raw, limit);
+    }
+    auto pos     = out.size();
+    out.resize(target);
+    zs.next_in   = (Bytef *) raw.data() + raw_pos;
+    zs.avail_in  = raw.size() - raw_pos;
+    zs.next_out  = (Bytef *) out.data() + pos;
+    zs.avail_out = target - pos;
+    auto ret     = deflate(&zs, raw_eof ? Z_FINISH : Z_NO_FLUSH);
+    raw_pos      = raw.size() - zs.avail_in;
+    out.resize(target - zs.avail_out);
+    if (ret == Z_STREAM_END) return false;
+    if (ret == Z_STREAM_ERROR) throw std::runtime_error("deflate");
+  }
+  return true;
+}
+
+// The entry name relative to root, or an error when it is absolute or climbs out of it
+static fs::path relative_name(std::string const &name) {
+  auto rel = fs::path(name).lexically_normal();
+  if (rel.empty() || rel.is_absolute() || *rel.begin() == "..")
+    throw std::invalid_argument("unsafe path in archive: " + name);
+  return rel;
+}
+
+tar_reader::tar_reader(fs::path root, bool gzip) : root(std::move(root)), gzip(gzip) {
+  fs::create_directories(this->root);
+  rootfd = open(this->root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rootfd == -1) throw syserror("open");
+  if (gzip) {
+    zs = {};
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+      close(rootfd);
+      throw std::runtime_error("inflateInit");
+    }
+  }
+}
+
+tar_reader::~tar_reader() {
+  if (file != -1) close(file);
+  close(rootfd);
+  if (gzip) inflateEnd(&zs);
+}
+
+// Walks down from root one component at a time (creating what is missing when asked). O_NOFOLLOW refuses a symlink on
+// the way, whether it was there before or came earlier in the archive, so no entry can land outside of root.
+int tar_reader::open_dir(fs::path const &rel, bool create) {
+  int dir = openat(rootfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir == -1) throw syserror("openat");
+  for (auto &part : rel) {
+    if (part.empty() || part == ".") continue;
+    int next = openat(dir, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (next == -1 && errno == ENOENT && create && (mkdirat(dir, part.c_str(), 0777) == 0 || errno == EEXIST))
+      next = openat(dir, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int err = errno;
+    close(dir);
+    if (next == -1) {
+      if (err == ELOOP || err == ENOTDIR) throw std::invalid_argument("unsafe path in archive: " + rel.string());
+      errno = err;
+      throw syserror("openat");
+    }
+    dir = next;
+  }
+  return dir;
+}
+
+void tar_reader::feed(std::string_view data) {
+  if (!gzip) return consume(data);
+  static thread_local char buffer[65536];
+  zs.next_in  = (Bytef *) data.data();
+  zs.avail_in = data.size();
+  do {
+    zs.next_out  = (Bytef *) buffer;
+    zs.avail_out = sizeof buffer;
+    auto ret     = inflate(&zs, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) throw std::runtime_error("inflate");
+    consume({buffer, sizeof buffer - zs.avail_out});
+    if (ret == Z_STREAM_END) break;
+  } while (zs.avail_out == 0);
+}
+
+void tar_reader::consume(std::string_view data) {
+  while (!data.empty() && !done) {
+    if (remain) {
+      auto len = (size_t) std::min<uintmax_t>(remain, data.size());
+      on_data(data.substr(0, len));
+      data.remove_prefix(len);
+      if ((remain -= len) == 0) on_entry_end();
+    } else if (padding) {
+      auto len = std::min(padding, data.size());
+      data.remove_prefix(len);
+      padding -= len;
+    } else {
+      auto len = std::min(block_size - header.size(), data.size());
+      header.append(data.data(), len);
+      data.remove_prefix(len);
+      if (header.size() == block_size) {
+        on_header();
+        header.clear();
+      }
+    }
+  }
+}
+
+void tar_reader::on_header() {
+  auto h = header.data();
+  if (header.find_first_not_of('\0') == std::string::npos) {
+    if (++zero_blocks == 2) done = true;
+    return;
+  }
+  zero_blocks = 0;
+  if (parse_number(h + 148, 8) != checksum(h)) throw std::runtime_error("bad tar header checksum");
+  type    = h[156];
+  remain  = parse_number(h + 124, 12);
+  padding = (block_size - remain % block_size) % block_size;
+  if (type == 'L') {
+    long_name.clear();
+  } else if (type == 'K') {
+    long_link.clear();
+  } else {
+    name = std::string(h, strnlen(h, 100));
+    link = std::string(h + 157, strnlen(h + 157, 100));
+    if (!memcmp(h + 257, "ustar", 6) && h[345]) name = std::string(h + 345, strnlen(h + 345, 155)) + "/" + name;
+    if (!long_name.empty()) name = std::move(long_name);
+    if (!long_link.empty()) link = std::move(long_link);
+    long_name.clear();
+    long_link.clear();
+    auto mode = (mode_t) parse_number(h + 100, 8) & 07777;
+    auto rel  = relative_name(name);
+    if (type == '5') {
+      close(open_dir(rel, true));
+    } else if (type == '\0' || type == '0' || type == '7' || type == '1' || type == '2') {
+      auto leaf = rel.filename();
+      if (leaf.empty() || leaf == ".") throw std::invalid_argument("unsafe path in archive: " + name);
+      // Links are checked before anything is touched: a symlink must stay inside root from where it is created
+      fs::path target;
+      if (type == '2') {
+        auto resolved = (rel.parent_path() / link).lexically_normal();
+        if (link.empty() || fs::path(link).is_absolute() || (!resolved.empty() && *resolved.begin() == ".."))
+          throw std::invalid_argument("unsafe link in archive: " + name + " -> " + link);
+      } else if (type == '1')
+        target = relative_name(link);
+      scoped_fd source{type == '1' ? open_dir(target.parent_path(), false) : -1};
+      scoped_fd dir{open_dir(rel.parent_path(), true)};
+      // Whatever sits there already (a symlink included) is replaced rather than written through
+      unlinkat(dir.fd, leaf.c_str(), 0);
+      if (type == '2') {
+        if (symlinkat(link.c_str(), dir.fd, leaf.c_str()) == -1) throw syserror("symlinkat");
+      } else if (type == '1') {
+        if (linkat(source.fd, target.filename().c_str(), dir.fd, leaf.c_str(), 0) == -1) throw syserror("linkat");
+      } else {
+        file = openat(dir.fd, leaf.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+        if (file == -1) throw syserror("openat");
+      }
+    }
+  }
+  if (remain == 0) on_entry_end();
+}
+
+void tar_reader::on_data(std::string_view data) {
+  switch (type) {
+  case 'L': long_name.append(data); break;
+  case 'K': long_link.append(data); break;
+  default:
+    if (file == -1) break;
+    while (!data.empty()) {
+      auto ret = write(file, data.data(), data.size());
+      if (ret == -1) throw syserror("write");
+      data.remove_prefix(ret);
+    }
+  }
+}
+
+void tar_reader::on_entry_end() {
+  switch (type) {
+  case 'L': long_name.resize(strnlen(long_name.c_str(), long_name.size())); break;
+  case 'K': long_link.resize(strnlen(long_link.c_str(), long_link.size())); break;
+  default:
+    if (file != -1) close(file);
+    file = -1;
+  }
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+
+// Produces a ustar stream of a directory tree piece by piece, so the whole archive never sits in memory.
+class tar_writer {
+  std::filesystem::path root;
+  std::filesystem::recursive_directory_iterator it;
+  bool gzip, started = false, finished = false, raw_eof = false;
+  int file     = -1;
+  uintmax_t remain = 0;
+  size_t padding   = 0;
+  std::string pending, raw;
+  size_t raw_pos = 0;
+  z_stream zs;
+
+  bool fill(std::string &out, size_t limit);
+  void emit_header(std::filesystem::directory_entry const &entry);
+
+public:
+  tar_writer(std::filesystem::path root, bool gzip);
+  tar_writer(tar_writer const &) = delete;
+  ~tar_writer();
+  // Appends at most limit bytes to out, returns false once the archive is complete. Throws when walking the tree
+  // fails, the archive is incomplete then.
+  bool next(std::string &out, size_t limit);
+};
+
+// Unpacks a ustar (or gzip compressed ustar) stream fed in arbitrary chunks below root, never through a symlink.
+class tar_reader {
+  std::filesystem::path root;
+  bool gzip, done = false;
+  int rootfd, file = -1;
+  char type;
+  uintmax_t remain = 0;
+  size_t padding   = 0;
+  unsigned zero_blocks = 0;
+  std::string header, long_name, long_link, name, link;
+  z_stream zs;
+
+  int open_dir(std::filesystem::path const &rel, bool create);
+  void consume(std::string_view data);
+  void on_header();
+  void on_data(std::string_view data);
+  void on_entry_end();
+
+public:
+  tar_reader(std::filesystem::path root, bool gzip);
+  tar_reader(tar_reader const &) = delete;
+  ~tar_reader();
+  void feed(std::string_view data);
+  inline bool finished() const { return done; }
+};
\ No newline at end of file
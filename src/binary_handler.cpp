@@ -1,25 +1,41 @@
 #include "binary_handler.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <netinet/in.h>
 #include <rpc.hpp>
+#include <sys/wait.h>
 #include <tuple>
 #include <unistd.h>
 
-static constexpr uint32_t magic = (1ul << 31);
+static constexpr uint32_t magic       = (1ul << 31);
+static constexpr uint32_t exit_flag   = (1ul << 30);
+static constexpr size_t archive_chunk = 16384;
 
 bool binary_handler::check_terminal_link(client_handler handler, terminal_manager::ID id) {
-  auto it = termset.get<client_handler>().find(handler);
-  return it != termset.get<client_handler>().end() && it->id == id;
+  std::lock_guard lock{mtx};
+  auto it = termset.get<term_id>().find(id);
+  return it != termset.get<term_id>().end() && it->handler == handler;
+}
+
+std::set<binary_handler::term_id> binary_handler::get_orphan_terminal() {
+  std::lock_guard lock{mtx};
+  return orphan_term;
 }
 
 void binary_handler::on_remove(client_handler handler) {
+  std::lock_guard lock{mtx};
   bincache.erase(handler);
+  sent.erase(handler);
+  outboxes.erase(handler);
+  archives.erase(handler);
+  unarchives.erase(handler);
   auto &hset = termset.get<client_handler>();
   auto it    = hset.lower_bound(handler);
   auto end   = hset.upper_bound(handler);
   while (it != end) {
     orphan_term.insert(it->id);
+    release_flow(it->id);
     it = hset.erase(it);
   }
 }
@@ -31,32 +47,226 @@ void binary_handler::on_binary(client_handler handler, std::string_view data) {
   data.remove_prefix(sizeof id);
   if (id >= magic) {
     id -= magic;
-    if (check_terminal_link(handler, id)) { write(id, data.data(), data.size()); }
+    {
+      std::lock_guard lock{mtx};
+      if (!check_terminal_link(handler, id)) return;
+      if (recorder) recorder->input(id, data);
+    }
+    // A child that stops reading its input blocks this write, other reactors must not wait on it
+    write(id, data.data(), data.size());
   } else {
+    std::lock_guard lock{mtx};
     bincache[handler][id] = data;
   }
 }
 
+// A frame goes out right away when nothing of its class or above is waiting, otherwise it is queued and the client's
+// loop drains the queue, so a backlog of bulk frames never sits in front of terminal output. Returns true when the
+// caller is to send it, which it does once it released the lock: encrypting and writing to the socket under the lock
+// every reactor shares would serialize all traffic. Only the client's own loop sends to it, so the order holds.
+bool binary_handler::deliver(mailbox *owner, client_handler const &handler, std::string_view data, priority prio) {
+  auto &counter = sent[handler];
+  counter.bytes += data.size();
+  counter.frames++;
+  auto home = owner ? owner : mailbox::current;
+  if (!home) return true;
+  auto &box = outboxes[handler];
+  if (!box.owner) box.owner = home;
+  auto level = (size_t) prio;
+  bool ahead = false;
+  for (size_t i = 0; i <= level; i++) ahead |= !box.queues[i].empty();
+  if (!ahead && prio != priority::bulk && home->owned()) return true;
+  box.queues[level].emplace_back(data);
+  box.queued[level] += data.size();
+  // Bulk waiting for its next quantum keeps its timer, anything else is drained on the next loop turn
+  if (box.posted || (prio == priority::bulk && box.paced)) return false;
+  box.posted = true;
+  home->post([this, weak = std::weak_ptr{handler}] {
+    if (auto handler = weak.lock()) flush(handler, false);
+  });
+  return false;
+}
+
+// The client may be gone by the time this runs, on_remove dropped its queue then. Interactive frames and replies are
+// all handed over. Bulk competing with them goes out at most `bulk_quantum` per `mailbox::defer_delay_ns`: the
+// transport takes whatever it is given and tells nothing about its socket, so pacing is what keeps a bulk backlog from
+// piling up there ahead of the terminal output. With nothing else waiting bulk is handed over in full.
+void binary_handler::flush(client_handler const &handler, bool paced) {
+  std::unique_lock lock{mtx};
+  auto it = outboxes.find(handler);
+  if (it == outboxes.end()) return;
+  auto &box = it->second;
+  (paced ? box.paced : box.posted) = false;
+  bool contended = !box.queues[(size_t) priority::interactive].empty() || !box.queues[(size_t) priority::reply].empty();
+  std::vector<std::string> frames;
+  take(box, priority::interactive, SIZE_MAX, frames);
+  take(box, priority::reply, SIZE_MAX, frames);
+  // While a quantum is pending the bulk class waits for it
+  if (!box.paced) {
+    take(box, priority::bulk, contended ? bulk_quantum : SIZE_MAX, frames);
+    if (!box.queues[(size_t) priority::bulk].empty()) {
+      box.paced = true;
+      box.owner->defer([this, weak = std::weak_ptr{handler}] {
+        if (auto handler = weak.lock()) flush(handler, true);
+      });
+    }
+  }
+  // Producers read and send more right away, so they run with the lock released as well
+  std::vector<std::function<void()>> drained;
+  if (box.queued[(size_t) priority::bulk] <= bulk_quantum) drained.swap(box.drained);
+  lock.unlock();
+  for (auto &frame : frames) handler->send(frame, rpc::message_type::BINARY);
+  for (auto &fn : drained) fn();
+}
+
+void binary_handler::take(outbox &box, priority prio, size_t budget, std::vector<std::string> &frames) {
+  auto level  = (size_t) prio;
+  auto &queue = box.queues[level];
+  while (!queue.empty() && budget) {
+    frames.push_back(std::move(queue.front()));
+    queue.pop_front();
+    box.queued[level] -= frames.back().size();
+    budget -= std::min(budget, frames.back().size());
+  }
+}
+
+void binary_handler::send(client_handler handler, std::string_view data, priority prio) {
+  std::unique_lock lock{mtx};
+  if (!deliver(nullptr, handler, data, prio)) return;
+  lock.unlock();
+  handler->send(data, rpc::message_type::BINARY);
+}
+
+bool binary_handler::backlogged(client_handler handler, std::function<void()> on_drained) {
+  std::lock_guard lock{mtx};
+  auto it = outboxes.find(handler);
+  if (it == outboxes.end() || it->second.queued[(size_t) priority::bulk] < bulk_high_water) return false;
+  it->second.drained.push_back(std::move(on_drained));
+  return true;
+}
+
+binary_handler::traffic binary_handler::traffic_of(client_handler handler) {
+  std::lock_guard lock{mtx};
+  auto it = sent.find(handler);
+  auto ret = it == sent.end() ? traffic{} : it->second;
+  if (auto box = outboxes.find(handler); box != outboxes.end()) ret.queued = box->second.bytes();
+  return ret;
+}
+
+binary_handler::usage_info binary_handler::usage() {
+  std::lock_guard lock{mtx};
+  usage_info info;
+  for (auto &[handler, cache] : bincache) {
+    info.blobs += cache.size();
+    for (auto &[id, blob] : cache) info.blob_bytes += blob.size();
+  }
+  info.orphans = orphan_term.size();
+  for (auto &[handler, counter] : sent) {
+    info.clients.push_back(counter);
+    if (auto box = outboxes.find(handler); box != outboxes.end()) info.clients.back().queued = box->second.bytes();
+  }
+  return info;
+}
+
 void binary_handler::on_data(term_id id, std::string_view data) {
+  std::unique_lock lock{mtx};
+  if (recorder) recorder->output(id, data.substr(sizeof(term_id)));
+  auto it = termset.get<term_id>().find(id);
+  if (it == termset.get<term_id>().end()) return;
+  auto handler = it->handler;
+  bool now     = deliver(it->owner, handler, data, priority::interactive);
+  if (auto flow = flows.find(id); flow != flows.end()) {
+    auto &state   = flow->second;
+    state.unacked += data.size() - sizeof(term_id);
+    if (!state.paused && state.unacked >= state.window) {
+      state.paused = true;
+      if (manager) manager->pause_terminal(id);
+    }
+  }
+  lock.unlock();
+  if (now) handler->send(data, rpc::message_type::BINARY);
+}
+
+// argv[0] is the first of args, the recorded command line is the program followed by the real arguments
+void binary_handler::on_open(term_id id, std::string const &program, std::vector<std::string> const &args) {
+  std::lock_guard lock{mtx};
+  if (!recorder) return;
+  std::string command = program;
+  for (size_t i = 1; i < args.size(); i++) command += " " + args[i];
+  recorder->open(id, command);
+}
+
+void binary_handler::release_flow(term_id id) {
+  auto flow = flows.find(id);
+  if (flow == flows.end()) return;
+  bool paused = flow->second.paused;
+  flows.erase(flow);
+  if (paused && manager) manager->resume_terminal(id);
+}
+
+void binary_handler::set_terminal_window(client_handler handler, term_id id, size_t window) {
+  std::lock_guard lock{mtx};
+  if (!check_terminal_link(handler, id)) throw std::invalid_argument("terminal not linked");
+  release_flow(id);
+  if (window) flows[id].window = window;
+}
+
+void binary_handler::ack_terminal(client_handler handler, term_id id, size_t bytes) {
+  std::lock_guard lock{mtx};
+  if (!check_terminal_link(handler, id)) return;
+  auto flow = flows.find(id);
+  if (flow == flows.end()) return;
+  auto &state   = flow->second;
+  state.unacked -= std::min(bytes, state.unacked);
+  if (state.paused && state.unacked <= state.window / 2) {
+    state.paused = false;
+    if (manager) manager->resume_terminal(id);
+  }
+}
+
+void binary_handler::on_exit(term_id id, int status, rusage const &usage) {
+  std::unique_lock lock{mtx};
   auto it = termset.get<term_id>().find(id);
   if (it == termset.get<term_id>().end()) return;
-  it->handler->send(data, rpc::message_type::BINARY);
+  auto micros = [](timeval const &tv) { return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec; };
+  rpc::json report = {
+      {"code", WIFEXITED(status) ? rpc::json(WEXITSTATUS(status)) : rpc::json(nullptr)},
+      {"signal", WIFSIGNALED(status) ? rpc::json(WTERMSIG(status)) : rpc::json(nullptr)},
+      {"core_dumped", WIFSIGNALED(status) && WCOREDUMP(status)},
+      {"utime_us", micros(usage.ru_utime)},
+      {"stime_us", micros(usage.ru_stime)},
+      {"maxrss_kb", usage.ru_maxrss},
+  };
+  uint32_t nid = htonl(id | magic | exit_flag);
+  std::string frame{(char const *) &nid, sizeof nid};
+  frame += report.dump();
+  auto handler = it->handler;
+  if (!deliver(it->owner, handler, frame, priority::interactive)) return;
+  lock.unlock();
+  handler->send(frame, rpc::message_type::BINARY);
 }
 
 void binary_handler::on_close(term_id id) {
+  std::unique_lock lock{mtx};
+  orphan_term.erase(id);
+  flows.erase(id);
+  if (recorder) recorder->close(id);
   auto it = termset.get<term_id>().find(id);
   if (it == termset.get<term_id>().end()) return;
   union {
     uint32_t id;
     char buf[sizeof(uint32_t)];
   } u;
-  u.id = htonl(id + magic);
-  it->handler->send({u.buf, sizeof(uint32_t)}, rpc::message_type::BINARY);
+  u.id         = htonl(id + magic);
+  auto handler = it->handler;
+  bool now     = deliver(it->owner, handler, {u.buf, sizeof(uint32_t)}, priority::interactive);
   termset.get<term_id>().erase(it);
-  orphan_term.erase(it->id);
+  lock.unlock();
+  if (now) handler->send({u.buf, sizeof(uint32_t)}, rpc::message_type::BINARY);
 }
 
 std::string binary_handler::get(client_handler handler, uint32_t id) {
+  std::lock_guard lock{mtx};
   auto &cache = this->bincache[handler];
   auto it     = cache.find(id);
   if (it == cache.end()) throw std::invalid_argument("blob not found");
@@ -66,18 +276,121 @@ std::string binary_handler::get(client_handler handler, uint32_t id) {
 }
 
 void binary_handler::link_terminal(client_handler handler, terminal_manager::ID id) {
-  termset.insert({id, std::move(handler)});
+  std::lock_guard lock{mtx};
+  if (!termset.insert({id, std::move(handler), mailbox::current}).second)
+    throw std::invalid_argument("terminal already linked");
 }
 
 void binary_handler::link_orphan_terminal(client_handler handler, terminal_manager::ID id) {
+  std::lock_guard lock{mtx};
   if (orphan_term.count(id) == 0) throw std::invalid_argument("id is not orphan");
   orphan_term.erase(id);
-  termset.insert({id, std::move(handler)});
+  link_terminal(std::move(handler), id);
 }
 
 void binary_handler::unlink_terminal(client_handler handler, terminal_manager::ID id) {
+  std::lock_guard lock{mtx};
   auto it = termset.get<term_id>().find(id);
-  if (it == termset.get<term_id>().end()) return;
+  if (it == termset.get<term_id>().end() || it->handler != handler) return;
   termset.get<term_id>().erase(it);
   orphan_term.insert(id);
+  release_flow(id);
+}
+
+// The tree walk, file reads and deflate run outside the lock, which every reactor shares, only the stream table and
+// the queues are touched under it. A stream is only driven by its client's own loop, so it is never pumped twice.
+void binary_handler::pump_archive(client_handler handler, uint32_t id) {
+  std::shared_ptr<archive_stream> stream;
+  {
+    std::lock_guard lock{mtx};
+    auto &streams = archives[handler];
+    auto it       = streams.find(id);
+    if (it == streams.end()) throw std::invalid_argument("stream not found");
+    stream = it->second;
+  }
+  static thread_local std::string frame;
+  uint32_t nid = htonl(id);
+  for (;;) {
+    {
+      std::lock_guard lock{mtx};
+      if (!stream->credit) return;
+    }
+    frame.assign((char const *) &nid, sizeof nid);
+    bool more;
+    try {
+      more = stream->writer->next(frame, archive_chunk);
+    } catch (...) {
+      close_archive(handler, id);
+      throw;
+    }
+    std::unique_lock lock{mtx};
+    // Cancelled meanwhile, or the client is gone
+    auto owner = archives.find(handler);
+    if (owner == archives.end()) return;
+    auto it = owner->second.find(id);
+    if (it == owner->second.end() || it->second != stream) return;
+    bool now = false, end_now = false;
+    if (frame.size() > sizeof nid) {
+      now = deliver(nullptr, handler, frame, priority::bulk);
+      stream->credit--;
+    }
+    // An empty frame marks the end of the stream, like terminal close
+    if (!more) {
+      end_now = deliver(nullptr, handler, {(char const *) &nid, sizeof nid}, priority::bulk);
+      owner->second.erase(it);
+    }
+    lock.unlock();
+    if (now) handler->send(frame, rpc::message_type::BINARY);
+    if (end_now) handler->send({(char const *) &nid, sizeof nid}, rpc::message_type::BINARY);
+    if (!more) return;
+  }
+}
+
+void binary_handler::open_archive(
+    client_handler handler, uint32_t id, std::unique_ptr<tar_writer> writer, unsigned window) {
+  {
+    std::lock_guard lock{mtx};
+    archives[handler][id] = std::make_shared<archive_stream>(archive_stream{std::move(writer), window});
+  }
+  pump_archive(std::move(handler), id);
+}
+
+void binary_handler::ack_archive(client_handler handler, uint32_t id, unsigned count) {
+  {
+    std::lock_guard lock{mtx};
+    auto &streams = archives[handler];
+    auto it       = streams.find(id);
+    if (it == streams.end()) throw std::invalid_argument("stream not found");
+    it->second->credit += count;
+  }
+  pump_archive(std::move(handler), id);
+}
+
+void binary_handler::close_archive(client_handler handler, uint32_t id) {
+  std::lock_guard lock{mtx};
+  archives[handler].erase(id);
+}
+
+void binary_handler::open_unarchive(client_handler handler, uint32_t id, std::unique_ptr<tar_reader> reader) {
+  std::lock_guard lock{mtx};
+  unarchives[handler][id] = std::move(reader);
+}
+
+// Unpacking writes files, so it runs outside the lock like pump_archive
+bool binary_handler::feed_unarchive(client_handler handler, uint32_t id, std::string_view data) {
+  std::shared_ptr<tar_reader> reader;
+  {
+    std::lock_guard lock{mtx};
+    auto &streams = unarchives[handler];
+    auto it       = streams.find(id);
+    if (it == streams.end()) throw std::invalid_argument("stream not found");
+    reader = it->second;
+  }
+  reader->feed(data);
+  return reader->finished();
+}
+
+void binary_handler::close_unarchive(client_handler handler, uint32_t id) {
+  std::lock_guard lock{mtx};
+  unarchives[handler].erase(id);
 }
\ No newline at end of file
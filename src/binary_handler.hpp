@@ -7,13 +7,21 @@
 #include <boost/multi_index/tag.hpp>
 #include <boost/multi_index_container_fwd.hpp>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <rpc.hpp>
 #include <set>
+#include <vector>
 
+#include "archive.hpp"
+#include "mailbox.hpp"
+#include "recorder.hpp"
 #include "terminal_manager.hpp"
 
+// Shared by every reactor, terminal output is handed over to the loop that owns the client.
 struct binary_handler : rpc::RPC::callback, terminal_manager::callback {
   using client_handler = rpc::RPC::client_handler;
   using term_id        = terminal_manager::ID;
@@ -23,19 +31,75 @@ struct binary_handler : rpc::RPC::callback, terminal_manager::callback {
 
   void on_data(term_id, std::string_view) override;
   void on_close(term_id) override;
+  void on_open(term_id, std::string const &program, std::vector<std::string> const &args) override;
+  // Reported to the linked client as a JSON frame on the terminal id with bit 30 set, before the closing frame
+  void on_exit(term_id, int status, rusage const &usage) override;
+
+  // Set once before the reactors start, every terminal is recorded while it is present
+  std::shared_ptr<session_recorder> recorder;
+
+  struct traffic {
+    uint64_t bytes = 0, frames = 0, queued = 0;
+  };
+  // Outbound classes, drained in this order. Terminal frames are interactive, blobs answering a request are replies,
+  // file contents (archives, tails, preads) are bulk and go out after the reply of the call that produced them. While
+  // interactive frames or replies are waiting too, bulk goes out at most `bulk_quantum` bytes per
+  // `mailbox::defer_delay_ns`.
+  enum class priority { interactive, reply, bulk };
+  static constexpr size_t bulk_quantum = 65536;
+  // Producers of bulk frames stop reading ahead while `bulk_high_water` bytes of them wait in the client's queue
+  static constexpr size_t bulk_high_water = 4 * bulk_quantum;
+  struct usage_info {
+    size_t blobs = 0, blob_bytes = 0, orphans = 0;
+    std::vector<traffic> clients;
+  };
+
+  // Sends a binary frame to a client of the calling reactor, accounted in its traffic
+  void send(client_handler, std::string_view, priority = priority::reply);
+  usage_info usage();
+  traffic traffic_of(client_handler);
+  // Whether the client's bulk queue is at `bulk_high_water`, `on_drained` then runs once on its loop when no more than
+  // one quantum is left (never if the client goes away first)
+  bool backlogged(client_handler, std::function<void()> on_drained);
 
   std::string get(client_handler, uint32_t);
   void link_terminal(client_handler, term_id);
   void link_orphan_terminal(client_handler, term_id);
   void unlink_terminal(client_handler, term_id);
   bool check_terminal_link(client_handler, term_id);
-  inline std::set<term_id> const &get_orphan_terminal() { return orphan_term; }
+  std::set<term_id> get_orphan_terminal();
+  // Output of the terminal pauses once `window` bytes are unacknowledged and resumes below half of it, 0 disables
+  void set_terminal_window(client_handler, term_id, size_t window);
+  void ack_terminal(client_handler, term_id, size_t bytes);
+
+  void open_archive(client_handler, uint32_t, std::unique_ptr<tar_writer>, unsigned window);
+  void ack_archive(client_handler, uint32_t, unsigned);
+  void close_archive(client_handler, uint32_t);
+  void open_unarchive(client_handler, uint32_t, std::unique_ptr<tar_reader>);
+  bool feed_unarchive(client_handler, uint32_t, std::string_view);
+  void close_unarchive(client_handler, uint32_t);
 
 private:
+  std::recursive_mutex mtx;
   std::map<client_handler, std::map<uint32_t, std::string>> bincache;
+  std::map<client_handler, traffic> sent;
+  struct outbox {
+    mailbox *owner = nullptr;
+    std::deque<std::string> queues[3];
+    size_t queued[3] = {};
+    // A flush is posted for the next loop turn / deferred for the next bulk quantum
+    bool posted = false, paced = false;
+    std::vector<std::function<void()>> drained;
+    inline size_t bytes() const { return queued[0] + queued[1] + queued[2]; }
+  };
+  std::map<client_handler, outbox> outboxes;
+  bool deliver(mailbox *owner, client_handler const &handler, std::string_view data, priority prio);
+  void flush(client_handler const &handler, bool paced);
+  void take(outbox &box, priority prio, size_t budget, std::vector<std::string> &frames);
   struct terminfo {
     term_id id;
     client_handler handler;
+    mailbox *owner;
   };
   using termset_t = boost::multi_index_container<
       terminfo, boost::multi_index::indexed_by<
@@ -46,4 +110,18 @@ private:
                         boost::multi_index::member<terminfo, client_handler, &terminfo::handler>>>>;
   termset_t termset;
   std::set<term_id> orphan_term;
+  struct flow_state {
+    size_t window = 0, unacked = 0;
+    bool paused   = false;
+  };
+  std::map<term_id, flow_state> flows;
+  void release_flow(term_id);
+  struct archive_stream {
+    std::unique_ptr<tar_writer> writer;
+    unsigned credit;
+  };
+  // Held by pointer so they can be worked on with the lock released
+  std::map<client_handler, std::map<uint32_t, std::shared_ptr<archive_stream>>> archives;
+  std::map<client_handler, std::map<uint32_t, std::shared_ptr<tar_reader>>> unarchives;
+  void pump_archive(client_handler, uint32_t);
 };
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Appends compact JSON straight to a string, byte for byte what nlohmann's dump() prints for the same document as long
+// as object keys are written in sorted order (nlohmann keeps them in a std::map).
+class json_writer {
+  std::string &out;
+  bool comma = false;
+
+  inline void separate() {
+    if (comma) out += ',';
+    comma = true;
+  }
+
+  // Same escapes as nlohmann's strict serializer, which also rejects invalid UTF-8
+  inline void escape(std::string_view str) {
+    static constexpr char hex[] = "0123456789abcdef";
+    out += '"';
+    size_t i = 0, n = str.size();
+    while (i < n) {
+      unsigned char c = str[i];
+      if (c >= 0x80) {
+        size_t len = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+        unsigned char lo = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+        unsigned char hi = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+        if (len == 0 || i + len > n) throw std::invalid_argument("invalid UTF-8 in string");
+        for (size_t j = 1; j < len; j++) {
+          unsigned char next = str[i + j];
+          if (next < (j == 1 ? lo : 0x80) || next > (j == 1 ? hi : 0xBF))
+            throw std::invalid_argument("invalid UTF-8 in string");
+        }
+        out.append(str.substr(i, len));
+        i += len;
+        continue;
+      }
+      switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\b': out += "\\b"; break;
+      case '\f': out += "\\f"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          out += "\\u00";
+          out += hex[c >> 4];
+          out += hex[c & 15];
+        } else
+          out += (char) c;
+      }
+      i++;
+    }
+    out += '"';
+  }
+
+public:
+  explicit json_writer(std::string &out) : out(out) {}
+
+  inline json_writer &begin_object() {
+    separate();
+    out += '{';
+    comma = false;
+    return *this;
+  }
+  inline json_writer &end_object() {
+    out += '}';
+    comma = true;
+    return *this;
+  }
+  inline json_writer &begin_array() {
+    separate();
+    out += '[';
+    comma = false;
+    return *this;
+  }
+  inline json_writer &end_array() {
+    out += ']';
+    comma = true;
+    return *this;
+  }
+  inline json_writer &key(std::string_view name) {
+    separate();
+    escape(name);
+    out += ':';
+    comma = false;
+    return *this;
+  }
+
+  inline json_writer &value(std::nullptr_t) {
+    separate();
+    out += "null";
+    return *this;
+  }
+  inline json_writer &value(bool flag) {
+    separate();
+    out += flag ? "true" : "false";
+    return *this;
+  }
+  inline json_writer &value(std::string_view str) {
+    separate();
+    escape(str);
+    return *this;
+  }
+  inline json_writer &value(char const *str) { return value(std::string_view{str}); }
+  template <typename T> inline std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>, json_writer &> value(T num) {
+    separate();
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof buf, (std::conditional_t<std::is_enum_v<T>, int64_t, T>) num);
+    out.append(buf, res.ptr);
+    return *this;
+  }
+
+  template <typename T> inline json_writer &field(std::string_view name, T const &val) { return key(name).value(val); }
+};
\ No newline at end of file
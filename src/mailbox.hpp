@@ -0,0 +1,87 @@
+#pragma once
+
+#include <epoll.hpp>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+// Runs closures posted from any thread on the epoll loop that owns the mailbox
+class mailbox {
+  int evfd, tfd;
+  std::shared_ptr<epoll> ep;
+  std::mutex mtx;
+  std::vector<std::function<void()>> queue, deferred;
+  bool armed = false;
+
+public:
+  static inline thread_local mailbox *current = nullptr;
+  static constexpr long defer_delay_ns        = 1000000;
+
+  mailbox(std::shared_ptr<epoll> ep) : ep(std::move(ep)) {
+    evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    this->ep->add(EPOLLIN, evfd, this->ep->reg([this](const epoll_event &ev) {
+      uint64_t count;
+      read(evfd, &count, sizeof count);
+      std::vector<std::function<void()>> tasks;
+      {
+        std::lock_guard lock{mtx};
+        tasks.swap(queue);
+      }
+      for (auto &task : tasks) task();
+    }));
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    this->ep->add(EPOLLIN, tfd, this->ep->reg([this](const epoll_event &ev) {
+      uint64_t count;
+      read(tfd, &count, sizeof count);
+      std::vector<std::function<void()>> tasks;
+      {
+        std::lock_guard lock{mtx};
+        tasks.swap(deferred);
+        armed = false;
+      }
+      for (auto &task : tasks) task();
+    }));
+  }
+
+  ~mailbox() {
+    ep->del(evfd);
+    close(evfd);
+    ep->del(tfd);
+    close(tfd);
+  }
+
+  inline bool owned() const { return current == this; }
+
+  void post(std::function<void()> task) {
+    {
+      std::lock_guard lock{mtx};
+      queue.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    write(evfd, &one, sizeof one);
+  }
+
+  // Runs the task about `defer_delay_ns` later, the loop sleeps (or serves other events) meanwhile. Everything deferred
+  // before the timer fires runs together.
+  void defer(std::function<void()> task) {
+    std::lock_guard lock{mtx};
+    deferred.push_back(std::move(task));
+    if (armed) return;
+    armed                  = true;
+    itimerspec timer       = {};
+    timer.it_value.tv_nsec = defer_delay_ns;
+    timerfd_settime(tfd, 0, &timer, nullptr);
+  }
+
+  // Runs the task right away when called from the owning loop
+  void dispatch(std::function<void()> task) {
+    if (owned())
+      task();
+    else
+      post(std::move(task));
+  }
+};
\ No newline at end of file
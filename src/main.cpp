@@ -6,6 +6,9 @@
 #include <rpc.hpp>
 #include <signal.h>
 #include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
 #include <yaml-cpp/exceptions.h>
 #include <yaml-cpp/mark.h>
 #include <yaml-cpp/node/node.h>
@@ -16,12 +19,43 @@
 
 #include "api.hpp"
 #include "binary_handler.hpp"
+#include "mailbox.hpp"
+#include "spawner.hpp"
+#include "terminal_manager.hpp"
 
 struct CheckFailed : std::runtime_error {
   YAML::Mark mark;
   CheckFailed(YAML::Mark mark, std::string msg) : runtime_error(std::move(msg)), mark(mark) {}
 };
 
+// The transport creates and binds its listening socket itself. The server is linked with --wrap=bind, so with more than
+// one reactor every TCP socket gets SO_REUSEPORT right before it is bound and each reactor can listen on the address.
+static bool share_port = false;
+
+extern "C" int __real_bind(int fd, sockaddr const *addr, socklen_t len);
+extern "C" int __wrap_bind(int fd, sockaddr const *addr, socklen_t len) {
+  int type = 0, one = 1;
+  socklen_t size = sizeof type;
+  if (share_port && (addr->sa_family == AF_INET || addr->sa_family == AF_INET6) &&
+      getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &size) == 0 && type == SOCK_STREAM)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+  return __real_bind(fd, addr, len);
+}
+
+// Read back from the sockets left listening (a unix socket address cannot be shared): every one needs SO_REUSEPORT
+static bool listeners_share_port() {
+  bool found = false;
+  for (auto &entry : std::filesystem::directory_iterator{"/proc/self/fd"}) {
+    int fd = std::stoi(entry.path().filename().string()), listening = 0, reuse = 0;
+    socklen_t len = sizeof listening;
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening) continue;
+    len = sizeof reuse;
+    if (getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, &len) != 0 || !reuse) return false;
+    found = true;
+  }
+  return found;
+}
+
 template <typename T> T check(YAML::Node const &node, std::string name) {
   if (auto sub = node[name]; sub) {
     try {
@@ -38,29 +72,73 @@ int main() {
   try {
     signal(SIGPIPE, SIG_IGN);
     YAML::Node config = YAML::LoadFile("bedweb.yaml");
+    // Forked before the server grows (and before any thread exists), spawning from it stays cheap
+    std::shared_ptr<spawner> spawn;
+    if (config["spawner"].as<bool>(true))
+      spawn = spawner::start(config["shell_pool"].as<unsigned>(0), getenv("SHELL"), terminal_manager::default_winsize);
     api_config apicfg;
-    std::unique_ptr<ssl_context> ssl;
+    std::string cert, priv;
+    bool ssl = false;
     if (auto sslcfg = config["ssl"]; sslcfg && sslcfg.IsMap()) {
-      auto cert = check<std::string>(sslcfg, "cert");
-      auto priv = check<std::string>(sslcfg, "priv");
-      ssl       = std::make_unique<ssl_context>(cert, priv);
+      cert = check<std::string>(sslcfg, "cert");
+      priv = check<std::string>(sslcfg, "priv");
+      ssl  = true;
     }
     auto address        = check<std::string>(config, "listen");
+    auto threads        = config["threads"].as<unsigned>(1) ?: std::thread::hardware_concurrency();
     apicfg.period       = config["query_period"].as<unsigned>(1);
     apicfg.monitor_path = config["monitor_path"].as<std::string>("/");
-    auto ep             = std::make_shared<epoll>();
-    std::unique_ptr<server_wsio> wsio;
-    if (ssl)
-      wsio = std::make_unique<server_wsio>(std::move(ssl), address, ep);
-    else
-      wsio = std::make_unique<server_wsio>(address, ep);
-    auto binrecord = std::make_shared<binary_handler>();
-    RPC server(std::move(wsio), binrecord);
+    apicfg.io_uring     = config["io_uring"].as<bool>(true);
+    apicfg.stats_event  = config["stats_event"].as<bool>(false);
+    apicfg.record_path  = config["record_path"].as<std::string>("");
+    apicfg.spawn        = spawn;
+    auto binrecord      = std::make_shared<binary_handler>();
+    if (!apicfg.record_path.empty()) {
+      std::filesystem::create_directories(apicfg.record_path);
+      binrecord->recorder =
+          std::make_shared<session_recorder>(apicfg.record_path, config["record_gzip"].as<bool>(true));
+    }
 
-    prepare(server, binrecord, ep, apicfg);
+    // Every reactor owns an epoll loop and a listener on the same address, the kernel spreads the accepted clients
+    // (SO_REUSEPORT, set by the bind wrapper and checked once the first listener is up) and a client stays on the loop
+    // that accepted it.
+    share_port = threads > 1;
+    struct reactor {
+      std::shared_ptr<epoll> ep = std::make_shared<epoll>();
+      mailbox box{ep};
+      std::unique_ptr<RPC> server;
+    };
+    auto setup = [&] {
+      auto r           = std::make_unique<reactor>();
+      mailbox::current = &r->box;
+      std::unique_ptr<server_wsio> wsio;
+      if (ssl)
+        wsio = std::make_unique<server_wsio>(std::make_unique<ssl_context>(cert, priv), address, r->ep);
+      else
+        wsio = std::make_unique<server_wsio>(address, r->ep);
+      r->server = std::make_unique<RPC>(std::move(wsio), binrecord);
+      prepare(*r->server, binrecord, r->ep, apicfg);
+      r->server->start();
+      return r;
+    };
 
-    server.start();
-    ep->wait();
+    // The first reactor is set up before any thread starts, so the shared terminal manager (and its blocked SIGCHLD
+    // mask) belongs to the main thread
+    auto primary = setup();
+    if (threads > 1 && !listeners_share_port()) {
+      std::cerr << "The listener on " << address << " cannot be shared, running a single reactor" << std::endl;
+      threads = 1;
+    }
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++)
+      workers.emplace_back([&] {
+        try {
+          auto r = setup();
+          r->ep->wait();
+        } catch (std::exception const &ex) { std::cerr << "Reactor failed: " << ex.what() << std::endl; }
+      });
+    primary->ep->wait();
+    for (auto &worker : workers) worker.join();
     std::cerr << "done" << std::endl;
   } catch (YAML::BadFile const &) {
     std::cerr << "Failed to load config bedweb.yaml: file not found" << std::endl;
@@ -0,0 +1,244 @@
+#include "recorder.hpp"
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include "syserror.hpp"
+
+using rpc::json;
+
+static constexpr size_t ring_capacity = 4 << 20;
+static constexpr auto flush_interval  = std::chrono::milliseconds(50);
+static constexpr char replacement[]   = "\xEF\xBF\xBD";
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+spsc_ring::spsc_ring(size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) size <<= 1;
+  buffer = std::make_unique<char[]>(size);
+  mask   = size - 1;
+}
+
+void spsc_ring::copy_in(size_t pos, void const *src, size_t size) {
+  if (size == 0) return;
+  auto offset = pos & mask, first = std::min(size, mask + 1 - offset);
+  std::memcpy(buffer.get() + offset, src, first);
+  std::memcpy(buffer.get(), (char const *) src + first, size - first);
+}
+
+void spsc_ring::copy_out(size_t pos, void *dst, size_t size) const {
+  if (size == 0) return;
+  auto offset = pos & mask, first = std::min(size, mask + 1 - offset);
+  std::memcpy(dst, buffer.get() + offset, first);
+  std::memcpy((char *) dst + first, buffer.get(), size - first);
+}
+
+bool spsc_ring::push(header const &hdr, std::string_view payload) {
+  size_t pos = head.load(std::memory_order_relaxed), need = sizeof hdr + payload.size();
+  if (need > mask + 1 - (pos - tail.load(std::memory_order_acquire))) return false;
+  copy_in(pos, &hdr, sizeof hdr);
+  copy_in(pos + sizeof hdr, payload.data(), payload.size());
+  head.store(pos + need, std::memory_order_release);
+  return true;
+}
+
+// Escapes a chunk as the body of a JSON string. A UTF-8 sequence cut by the end of the chunk is kept in carry for the
+// next one, invalid bytes become U+FFFD so every line stays parseable.
+static void append_escaped(std::string &out, std::string &carry, std::string_view chunk) {
+  std::string joined;
+  if (!carry.empty()) {
+    joined = carry.append(chunk);
+    chunk  = joined;
+    carry.clear();
+  }
+  size_t i = 0, n = chunk.size();
+  while (i < n) {
+    unsigned char c = chunk[i];
+    if (c < 0x80) {
+      switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char buf[8];
+          std::snprintf(buf, sizeof buf, "\\u%04x", c);
+          out += buf;
+        } else
+          out += (char) c;
+      }
+      i++;
+      continue;
+    }
+    size_t len = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+    unsigned char lo = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+    unsigned char hi = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+    size_t j         = 1;
+    for (; j < len && i + j < n; j++) {
+      unsigned char next = chunk[i + j];
+      if (next < (j == 1 ? lo : 0x80) || next > (j == 1 ? hi : 0xBF)) break;
+    }
+    if (len && j == len) {
+      out.append(chunk.substr(i, len));
+      i += len;
+    } else if (len && i + j == n) {
+      carry.assign(chunk.substr(i));
+      break;
+    } else {
+      out += replacement;
+      i += j;
+    }
+  }
+}
+
+session_recorder::session_recorder(std::filesystem::path dir, bool gzip)
+    : dir(std::move(dir)), gzip(gzip), ring(ring_capacity), writer([this] { run(); }) {}
+
+session_recorder::~session_recorder() {
+  running = false;
+  writer.join();
+}
+
+void session_recorder::push(char kind, ID id, std::string_view payload) {
+  spsc_ring::header hdr{id, kind, (uint32_t) payload.size(), now_ns()};
+  if (!ring.push(hdr, payload)) lost.fetch_add(1, std::memory_order_relaxed);
+}
+
+void session_recorder::open(ID id, std::string_view command) { push('O', id, command); }
+void session_recorder::output(ID id, std::string_view data) { push('o', id, data); }
+void session_recorder::input(ID id, std::string_view data) { push('i', id, data); }
+void session_recorder::close(ID id) { push('C', id, {}); }
+
+void session_recorder::run() {
+  // Started before the reactors block SIGCHLD for their signalfd, the writer would be left the only thread to take it
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, nullptr);
+  while (running.load(std::memory_order_relaxed)) {
+    flush();
+    std::this_thread::sleep_for(flush_interval);
+  }
+  flush();
+  while (!sessions.empty()) finish(sessions.begin()->first);
+}
+
+void session_recorder::start(ID id, int64_t time, std::string_view command) {
+  if (sessions.count(id)) finish(id);
+  auto &sess = sessions[id];
+  sess.start = time;
+  auto wall  = std::chrono::system_clock::now() - std::chrono::nanoseconds(now_ns() - time);
+  auto ms    = std::chrono::duration_cast<std::chrono::milliseconds>(wall.time_since_epoch()).count();
+  auto path  = dir / (std::to_string(ms) + "-" + std::to_string(id) + (gzip ? ".cast.gz" : ".cast"));
+  sess.file  = gzopen(path.c_str(), gzip ? "wb6" : "wbT");
+  if (!sess.file) {
+    std::cerr << "Failed to record session " << path << ": " << strerror(errno) << std::endl;
+    return;
+  }
+  json header = {
+      {"version", 2},
+      {"width", 80},
+      {"height", 25},
+      {"timestamp", ms / 1000},
+      {"command", std::string{command}},
+  };
+  sess.batch = header.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+}
+
+void session_recorder::finish(ID id) {
+  auto it = sessions.find(id);
+  if (it == sessions.end()) return;
+  if (auto &sess = it->second; sess.file) {
+    gzwrite(sess.file, sess.batch.data(), sess.batch.size());
+    gzclose(sess.file);
+  }
+  sessions.erase(it);
+}
+
+// One drain per interval, the lines of a session are appended with a single write (and a sync flush for gzip, so a
+// running session can be replayed)
+void session_recorder::flush() {
+  ring.drain([&](spsc_ring::header const &hdr, std::string_view payload) {
+    if (hdr.kind == 'O') return start(hdr.id, hdr.time, payload);
+    if (hdr.kind == 'C') return finish(hdr.id);
+    if (!sessions.count(hdr.id)) start(hdr.id, hdr.time, {});
+    auto &sess = sessions[hdr.id];
+    if (!sess.file) return;
+    char prefix[40];
+    std::snprintf(prefix, sizeof prefix, "[%.6f, \"%c\", \"", (hdr.time - sess.start) / 1e9, hdr.kind);
+    sess.batch += prefix;
+    append_escaped(sess.batch, hdr.kind == 'o' ? sess.carry_out : sess.carry_in, payload);
+    sess.batch += "\"]\n";
+  });
+  for (auto &[id, sess] : sessions) {
+    if (!sess.file || sess.batch.empty()) continue;
+    gzwrite(sess.file, sess.batch.data(), sess.batch.size());
+    gzflush(sess.file, Z_SYNC_FLUSH);
+    sess.batch.clear();
+  }
+}
+
+static bool is_recording(std::string const &name) {
+  auto ends_with = [&](std::string_view suffix) {
+    return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+  };
+  return name.find('/') == std::string::npos && name[0] != '.' && (ends_with(".cast") || ends_with(".cast.gz"));
+}
+
+json session_recorder::list(std::filesystem::path const &dir) {
+  std::vector<std::string> names;
+  for (auto &entry : std::filesystem::directory_iterator(dir))
+    if (auto name = entry.path().filename().string(); entry.is_regular_file() && is_recording(name))
+      names.push_back(name);
+  std::sort(names.begin(), names.end());
+  auto ret = json::array();
+  for (auto &name : names) {
+    struct stat st;
+    if (stat((dir / name).c_str(), &st) != 0) continue;
+    ret.push_back({{"name", name}, {"size", st.st_size}, {"mtime", st.st_mtime}});
+  }
+  return ret;
+}
+
+// asciicast has no index, seeking reads (and inflates) every line before `from`
+json session_recorder::replay(std::filesystem::path const &dir, std::string const &name, double from, size_t limit) {
+  if (name.empty() || !is_recording(name)) throw std::invalid_argument("invalid recording name");
+  std::unique_ptr<gzFile_s, int (*)(gzFile)> file{gzopen((dir / name).c_str(), "rb"), gzclose};
+  if (!file) throw syserror("gzopen");
+  std::string line;
+  auto getline = [&] {
+    static thread_local char buffer[65536];
+    line.clear();
+    while (gzgets(file.get(), buffer, sizeof buffer)) {
+      line += buffer;
+      if (line.back() == '\n') return true;
+    }
+    return false;
+  };
+  if (!getline()) throw std::invalid_argument("empty recording");
+  auto header = json::parse(line);
+  auto events = json::array();
+  json next   = nullptr;
+  // The last line of a running session may be cut, it is left for the next call
+  while (getline()) {
+    auto event = json::parse(line, nullptr, false);
+    if (event.is_discarded() || !event.is_array() || event.empty()) break;
+    if (event[0].get<double>() < from) continue;
+    if (events.size() == limit) {
+      next = event[0];
+      break;
+    }
+    events.push_back(std::move(event));
+  }
+  return json::object({{"header", header}, {"events", events}, {"next", next}});
+}
\ No newline at end of file
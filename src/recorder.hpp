@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <rpc.hpp>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+// Bounded byte ring with one producer and one consumer, records are a fixed header followed by the payload.
+class spsc_ring {
+  std::unique_ptr<char[]> buffer;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+  void copy_in(size_t pos, void const *src, size_t size);
+  void copy_out(size_t pos, void *dst, size_t size) const;
+
+public:
+  struct header {
+    uint32_t id;
+    char kind;
+    uint32_t size;
+    int64_t time;
+  };
+
+  // capacity is rounded up to a power of two
+  explicit spsc_ring(size_t capacity);
+  // Returns false without blocking when the record does not fit
+  bool push(header const &hdr, std::string_view payload);
+  // Hands every record published so far to fn(header const &, std::string_view), returns how many there were
+  template <typename F> size_t drain(F &&fn);
+  size_t queued() const { return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed); }
+};
+
+// Records terminal sessions as asciicast v2 files (optionally gzip compressed) under a directory.
+// Producers only enqueue into the ring, a background thread formats and appends in batches, so the epoll threads never
+// touch the disk. Callers must serialize push calls (binary_handler does it with its mutex).
+class session_recorder {
+public:
+  using ID = uint32_t;
+
+  session_recorder(std::filesystem::path dir, bool gzip);
+  session_recorder(session_recorder const &) = delete;
+  ~session_recorder();
+
+  void open(ID id, std::string_view command);
+  void output(ID id, std::string_view data);
+  void input(ID id, std::string_view data);
+  void close(ID id);
+
+  uint64_t dropped() const { return lost.load(std::memory_order_relaxed); }
+  size_t queued() const { return ring.queued(); }
+
+  // Lists the recordings in dir, newest last
+  static rpc::json list(std::filesystem::path const &dir);
+  // Returns up to limit events starting at `from` seconds, with the header and the time of the next event for paging
+  static rpc::json replay(std::filesystem::path const &dir, std::string const &name, double from, size_t limit);
+
+private:
+  struct session {
+    gzFile file = nullptr;
+    int64_t start;
+    std::string batch, carry_out, carry_in;
+  };
+
+  std::filesystem::path dir;
+  bool gzip;
+  spsc_ring ring;
+  std::atomic<uint64_t> lost{0};
+  std::atomic<bool> running{true};
+  std::map<ID, session> sessions;
+  std::thread writer;
+
+  void push(char kind, ID id, std::string_view payload);
+  void run();
+  void flush();
+  void start(ID id, int64_t time, std::string_view command);
+  void finish(ID id);
+};
+
+template <typename F> size_t spsc_ring::drain(F &&fn) {
+  size_t pos = tail.load(std::memory_order_relaxed), end = head.load(std::memory_order_acquire), count = 0;
+  std::string payload;
+  while (pos != end) {
+    header hdr;
+    copy_out(pos, &hdr, sizeof hdr);
+    payload.resize(hdr.size);
+    copy_out(pos + sizeof hdr, payload.data(), hdr.size);
+    pos += sizeof hdr + hdr.size;
+    fn(hdr, std::string_view{payload});
+    count++;
+  }
+  tail.store(pos, std::memory_order_release);
+  return count;
+}
\ No newline at end of file
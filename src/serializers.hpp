@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <grp.h>
+#include <json.hpp>
+#include <optional>
+#include <pwd.h>
+#include <rpc.hpp>
+
+#include "json_writer.hpp"
+
+// Fix this for gcc 9.2.0
+struct hack_clock : std::filesystem::file_time_type::clock {
+  template <typename TargetDur, typename _Dur>
+  static std::chrono::time_point<std::filesystem::file_time_type::clock, TargetDur>
+  from_sys(const std::chrono::time_point<std::chrono::system_clock, _Dur> &__t) noexcept {
+    return std::chrono::time_point_cast<TargetDur>(_S_from_sys(__t));
+  }
+
+  template <typename TargetDur, typename _Dur>
+  static std::chrono::time_point<std::chrono::system_clock, TargetDur>
+  to_sys(const std::chrono::time_point<std::filesystem::file_time_type::clock, _Dur> &__t) noexcept {
+    return std::chrono::time_point_cast<TargetDur>(_S_to_sys(__t));
+  }
+};
+
+inline char const *file_type_name(std::filesystem::file_type type) {
+#define detect(name) type == std::filesystem::file_type::name ? #name:
+  return detect(block) detect(character) detect(directory) detect(fifo) detect(regular) detect(socket)
+      detect(symlink) "unknown";
+#undef detect
+}
+
+namespace nlohmann {
+template <typename T> struct adl_serializer<std::optional<T>> {
+  inline static void to_json(rpc::json &j, const std::optional<T> &opt) {
+    if (opt.has_value())
+      j = opt.value();
+    else
+      j = nullptr;
+  }
+};
+template <> struct adl_serializer<std::filesystem::file_type> {
+  inline static void to_json(rpc::json &j, const std::filesystem::file_type &type) { j = file_type_name(type); }
+};
+template <> struct adl_serializer<std::filesystem::directory_entry> {
+  inline static void to_json(rpc::json &j, const std::filesystem::directory_entry &entry) {
+    j = rpc::json::object({
+        {"name", entry.path().filename().c_str()},
+        {"type", entry.status().type()},
+        {"perm", entry.status().permissions()},
+        {"link", entry.hard_link_count()},
+        {"time", (unsigned long) hack_clock::to_sys<std::chrono::milliseconds>(entry.last_write_time())
+                     .time_since_epoch()
+                     .count()},
+    });
+  }
+};
+
+template <> struct adl_serializer<std::filesystem::file_status> {
+  inline static void to_json(rpc::json &j, const std::filesystem::file_status &status) {
+    j = rpc::json::object({
+        {"type", status.type()},
+        {"perm", status.permissions()},
+    });
+  }
+};
+template <> struct adl_serializer<passwd> {
+  inline static void to_json(rpc::json &j, const passwd &pd) {
+    j = rpc::json::object({
+        {"uid", pd.pw_uid},
+        {"gid", pd.pw_gid},
+        {"username", pd.pw_name},
+        {"realneme", pd.pw_gecos},
+        {"home", pd.pw_dir},
+        {"shell", pd.pw_shell},
+    });
+  }
+};
+template <> struct adl_serializer<group> {
+  inline static void to_json(rpc::json &j, const group &grp) {
+    auto members = rpc::json::array();
+    auto it      = grp.gr_mem;
+    while (*it) {
+      members.push_back(*it);
+      it++;
+    }
+    j = rpc::json::object({
+        {"gid", grp.gr_gid},
+        {"name", grp.gr_name},
+        {"members", members},
+    });
+  }
+};
+} // namespace nlohmann
+
+// DOM-free counterparts of the serializers above, fields in the same (sorted) order nlohmann prints them
+
+inline void write_json(json_writer &w, std::filesystem::directory_entry const &entry) {
+  auto status = entry.status();
+  w.begin_object()
+      .field("link", entry.hard_link_count())
+      .field("name", entry.path().filename().c_str())
+      .field("perm", status.permissions())
+      .field("time",
+             (unsigned long) hack_clock::to_sys<std::chrono::milliseconds>(entry.last_write_time())
+                 .time_since_epoch()
+                 .count())
+      .field("type", file_type_name(status.type()))
+      .end_object();
+}
+
+inline void write_json(json_writer &w, passwd const &pd) {
+  w.begin_object()
+      .field("gid", pd.pw_gid)
+      .field("home", pd.pw_dir)
+      .field("realneme", pd.pw_gecos)
+      .field("shell", pd.pw_shell)
+      .field("uid", pd.pw_uid)
+      .field("username", pd.pw_name)
+      .end_object();
+}
+
+inline void write_json(json_writer &w, group const &grp) {
+  w.begin_object().field("gid", grp.gr_gid).key("members").begin_array();
+  for (auto it = grp.gr_mem; *it; it++) w.value(*it);
+  w.end_array().field("name", grp.gr_name).end_object();
+}
\ No newline at end of file
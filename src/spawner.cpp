@@ -0,0 +1,221 @@
+#include "spawner.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sched.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "syserror.hpp"
+
+static constexpr size_t max_request = 65536;
+
+struct spawn_reply {
+  pid_t pid;
+  int error;
+};
+
+// Request: winsize followed by the program and its argv, each NUL terminated
+static std::string
+encode_request(std::string const &program, std::vector<std::string> const &args, winsize const &size) {
+  std::string buf{(char const *) &size, sizeof size};
+  buf.append(program.c_str(), program.size() + 1);
+  for (auto &arg : args) buf.append(arg.c_str(), arg.size() + 1);
+  return buf;
+}
+
+namespace {
+// Everything below runs in the helper, a single threaded copy of the process taken before the server started
+struct helper_state {
+  int sock;
+  std::string pool_key;
+  unsigned pool_size;
+  std::deque<spawner::child> pool;
+
+  // The child of a fork-like clone only runs async-signal-safe calls until exec
+  static pid_t spawn_pty(char const *program, char *const *argv, winsize const &size, int &master) {
+    int slave;
+    if (openpty(&master, &slave, nullptr, nullptr, &size) == -1) return -errno;
+    fcntl(master, F_SETFD, FD_CLOEXEC);
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, nullptr, nullptr, nullptr, nullptr);
+    if (pid == 0) {
+      close(master);
+      setsid();
+      ioctl(slave, TIOCSCTTY, 0);
+      dup2(slave, 0);
+      dup2(slave, 1);
+      dup2(slave, 2);
+      if (slave > 2) close(slave);
+      prctl(PR_SET_PDEATHSIG, SIGHUP);
+      execvp(program, argv);
+      _exit(127);
+    }
+    int err = errno;
+    close(slave);
+    if (pid == -1) {
+      close(master);
+      return -err;
+    }
+    return pid;
+  }
+
+  static pid_t spawn_request(std::string_view request, int &master) {
+    winsize size;
+    std::memcpy(&size, request.data(), sizeof size);
+    request.remove_prefix(sizeof size);
+    if (request.empty() || request.back() != '\0') return -EINVAL;
+    std::vector<char *> parts;
+    for (size_t pos = 0; pos < request.size(); pos = request.find('\0', pos) + 1)
+      parts.push_back(const_cast<char *>(request.data() + pos));
+    if (parts.empty()) return -EINVAL;
+    parts.push_back(nullptr);
+    return spawn_pty(parts[0], parts.data() + 1, size, master);
+  }
+
+  // A pooled shell that already exited left a hung up master behind
+  static bool alive(spawner::child const &entry) {
+    pollfd pfd{entry.master, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 0 || !(pfd.revents & POLLHUP);
+  }
+
+  void refill() {
+    while (pool.size() < pool_size) {
+      spawner::child entry;
+      entry.pid = spawn_request(pool_key, entry.master);
+      if (entry.pid < 0) return;
+      pool.push_back(entry);
+    }
+  }
+
+  void reply(pid_t pid, int master) {
+    spawn_reply rep{pid < 0 ? -1 : pid, pid < 0 ? -pid : 0};
+    iovec iov{&rep, sizeof rep};
+    msghdr msg{};
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    union {
+      char buf[CMSG_SPACE(sizeof(int))];
+      cmsghdr align;
+    } control;
+    if (pid >= 0) {
+      msg.msg_control    = control.buf;
+      msg.msg_controllen = sizeof control.buf;
+      auto cmsg          = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level   = SOL_SOCKET;
+      cmsg->cmsg_type    = SCM_RIGHTS;
+      cmsg->cmsg_len     = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), &master, sizeof master);
+    }
+    sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (pid >= 0) close(master);
+  }
+
+  [[noreturn]] void run() {
+    static char buffer[max_request];
+    refill();
+    for (;;) {
+      auto len = recv(sock, buffer, sizeof buffer, 0);
+      if (len <= 0) _exit(0);
+      if ((size_t) len < sizeof(winsize)) {
+        reply(-EINVAL, -1);
+        continue;
+      }
+      std::string_view request{buffer, (size_t) len};
+      // The pool only holds default sized shells, the size is part of the key
+      bool pooled = false;
+      while (!pool.empty() && request == pool_key) {
+        auto entry = pool.front();
+        pool.pop_front();
+        if (alive(entry)) {
+          reply(entry.pid, entry.master);
+          pooled = true;
+          break;
+        }
+        close(entry.master);
+      }
+      if (!pooled) {
+        int master;
+        auto pid = spawn_request(request, master);
+        reply(pid, master);
+      }
+      refill();
+    }
+  }
+};
+} // namespace
+
+std::shared_ptr<spawner> spawner::start(unsigned pool, char const *shell, winsize const &size) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) return nullptr;
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return nullptr;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    // Ignored signals stay ignored across exec, the programs get the default SIGPIPE back
+    signal(SIGPIPE, SIG_DFL);
+    helper_state state{fds[1]};
+    if (shell && pool) {
+      state.pool_key  = encode_request(shell, {"-l"}, size);
+      state.pool_size = pool;
+    }
+    state.run();
+  }
+  close(fds[1]);
+  return std::shared_ptr<spawner>{new spawner{fds[0]}};
+}
+
+spawner::~spawner() { close(sock); }
+
+std::optional<spawner::child>
+spawner::spawn(std::string const &program, std::vector<std::string> const &args, winsize const &size) {
+  auto request = encode_request(program, args, size);
+  if (request.size() > max_request) throw std::length_error("arguments");
+  std::lock_guard lock{mtx};
+  auto lost = [this] {
+    dead = true;
+    std::cerr << "The spawner helper is gone, terminals are forked by the server from now on" << std::endl;
+    return std::nullopt;
+  };
+  if (dead) return std::nullopt;
+  if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) == -1) {
+    if (errno != EPIPE && errno != ECONNRESET) throw syserror("spawner send");
+    return lost();
+  }
+  spawn_reply rep;
+  iovec iov{&rep, sizeof rep};
+  msghdr msg{};
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    cmsghdr align;
+  } control;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+  auto len           = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (len == -1 && errno != ECONNRESET) throw syserror("spawner recv");
+  if (len <= 0) return lost();
+  if (len != sizeof rep) throw std::runtime_error("spawner sent a short reply");
+  if (rep.pid == -1) {
+    errno = rep.error;
+    throw syserror("spawn");
+  }
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) throw std::runtime_error("spawner sent no pty");
+  child ret{rep.pid, -1};
+  std::memcpy(&ret.master, CMSG_DATA(cmsg), sizeof ret.master);
+  return ret;
+}
\ No newline at end of file
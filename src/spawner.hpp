@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <pty.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Client side of a helper process forked while the server is still small, which creates ptys and starts programs on
+// request and passes the pty master back over a unix socket (SCM_RIGHTS). Children are cloned with CLONE_PARENT, so
+// they are children of the server and its SIGCHLD handling keeps working unchanged.
+class spawner {
+  int sock;
+  std::mutex mtx;
+  // The helper exited or hung up, it cannot be restarted once the server runs threads
+  bool dead = false;
+
+  spawner(int sock) : sock(sock) {}
+
+public:
+  struct child {
+    pid_t pid;
+    int master;
+  };
+
+  // Must be called before any thread is started. With pool > 0 the helper keeps that many `shell -l` of the given size
+  // already running, requests for exactly that command take one of them. Returns nullptr if the helper cannot start.
+  static std::shared_ptr<spawner> start(unsigned pool, char const *shell, winsize const &size);
+  spawner(spawner const &) = delete;
+  ~spawner();
+
+  // args[0] is argv[0], as for alloc_terminal. Returns nothing once the helper is gone, the caller starts the program
+  // itself then.
+  std::optional<child> spawn(std::string const &program, std::vector<std::string> const &args, winsize const &size);
+};
\ No newline at end of file
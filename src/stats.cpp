@@ -0,0 +1,64 @@
+#include "stats.hpp"
+#include <algorithm>
+
+unsigned latency_histogram::index_of(uint64_t value) {
+  value = std::min<uint64_t>(value, (1ull << max_bits) - 1);
+  if (value < sub_count) return value;
+  unsigned shift = 63 - __builtin_clzll(value) - sub_bits;
+  return (shift + 1) * sub_count + ((value >> shift) & (sub_count - 1));
+}
+
+uint64_t latency_histogram::value_of(unsigned index) {
+  if (index < sub_count) return index;
+  unsigned shift = index / sub_count - 1;
+  uint64_t lower = (uint64_t) (sub_count + index % sub_count) << shift;
+  return lower + ((1ull << shift) >> 1);
+}
+
+void latency_histogram::record(uint64_t ns) {
+  counts[index_of(ns)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(ns, std::memory_order_relaxed);
+  auto current = max.load(std::memory_order_relaxed);
+  while (ns > current && !max.compare_exchange_weak(current, ns, std::memory_order_relaxed)) {}
+}
+
+rpc::json latency_histogram::to_json() const {
+  std::array<uint64_t, buckets> snapshot;
+  uint64_t count = 0;
+  for (unsigned i = 0; i < buckets; i++) count += snapshot[i] = counts[i].load(std::memory_order_relaxed);
+  if (count == 0) return rpc::json::object({{"count", 0}});
+  auto percentile = [&](double q) {
+    uint64_t rank = std::max<uint64_t>(1, q * count), seen = 0;
+    for (unsigned i = 0; i < buckets; i++)
+      if ((seen += snapshot[i]) >= rank) return value_of(i) / 1000.0;
+    return max.load(std::memory_order_relaxed) / 1000.0;
+  };
+  return rpc::json::object({
+      {"count", count},
+      {"mean_us", sum.load(std::memory_order_relaxed) / 1000.0 / total.load(std::memory_order_relaxed)},
+      {"p50_us", percentile(0.5)},
+      {"p90_us", percentile(0.9)},
+      {"p99_us", percentile(0.99)},
+      {"p999_us", percentile(0.999)},
+      {"max_us", max.load(std::memory_order_relaxed) / 1000.0},
+  });
+}
+
+server_stats &server_stats::global() {
+  static server_stats instance;
+  return instance;
+}
+
+latency_histogram &server_stats::method(std::string const &name) {
+  std::lock_guard lock{mtx};
+  return methods[name];
+}
+
+rpc::json server_stats::methods_json() {
+  std::lock_guard lock{mtx};
+  auto ret = rpc::json::object();
+  for (auto &[name, histogram] : methods)
+    if (auto stat = histogram.to_json(); stat["count"] != 0) ret[name] = std::move(stat);
+  return ret;
+}
\ No newline at end of file
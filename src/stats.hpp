@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <rpc.hpp>
+#include <string>
+
+// Log-linear (HDR style) histogram of nanosecond samples, 8 sub-buckets per power of two (~12% precision).
+// Recording is a couple of relaxed atomic increments, so it can be shared by every reactor.
+class latency_histogram {
+  static constexpr unsigned sub_bits  = 3;
+  static constexpr unsigned sub_count = 1 << sub_bits;
+  static constexpr unsigned max_bits  = 40;
+  static constexpr unsigned buckets   = (max_bits - sub_bits + 1) * sub_count;
+
+  std::array<std::atomic<uint64_t>, buckets> counts{};
+  std::atomic<uint64_t> total{0}, sum{0}, max{0};
+
+  static unsigned index_of(uint64_t value);
+  static uint64_t value_of(unsigned index);
+
+public:
+  void record(uint64_t ns);
+  rpc::json to_json() const;
+
+  struct scope {
+    latency_histogram &target;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    inline ~scope() {
+      target.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                        .count());
+    }
+  };
+};
+
+struct server_stats {
+  latency_histogram loop_lag;
+
+  static server_stats &global();
+  // The returned histogram lives as long as the process, handlers keep a reference to it
+  latency_histogram &method(std::string const &name);
+  rpc::json methods_json();
+
+private:
+  std::mutex mtx;
+  std::map<std::string, latency_histogram> methods;
+};
\ No newline at end of file
@@ -28,9 +28,9 @@ static std::optional<cpu_id_t> get_cpu_id() {
   return cpuid;
 }
 
-CPU::CPU() {
+CPU::CPU(char const *stat_path) {
   cpuid   = get_cpu_id();
-  stat    = std::ifstream{"/proc/stat"};
+  stat    = std::ifstream{stat_path};
   
   // timerfd_settime(timerfd, 0, &timer, nullptr);
   // epfd->add(EPOLLIN | EPOLLERR, timerfd, epfd->reg([this, callback](const epoll_event &ev) {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <ctime>
 #include <epoll.hpp>
 #include <fstream>
 #include <functional>
@@ -9,6 +10,8 @@
 #include <rpc.hpp>
 #include <vector>
 
+#include "../json_writer.hpp"
+
 namespace sys {
 
 class CPU {
@@ -35,7 +38,8 @@ private:
   std::vector<cpu_stat> stats;
 
 public:
-  CPU();
+  // stat_path can point at a recorded copy of /proc/stat
+  CPU(char const *stat_path = "/proc/stat");
   ~CPU();
   void snapshot();
   inline std::optional<cpu_id_t> const &getCPUID() const { return cpuid; }
@@ -58,6 +62,37 @@ template <> struct adl_serializer<sys::CPU::cpu_stat> {
 };
 } // namespace nlohmann
 
+inline void write_json(json_writer &w, sys::CPU::cpu_stat const &stat) {
+  w.begin_object()
+      .field("guest", stat.guest)
+      .field("guest_nice", stat.guest_nice)
+      .field("idle", stat.idle)
+      .field("iowait", stat.iowait)
+      .field("irq", stat.irq)
+      .field("nice", stat.nice)
+      .field("softirq", stat.softirq)
+      .field("steal", stat.steal)
+      .field("systm", stat.systm)
+      .field("user", stat.user)
+      .end_object();
+}
+
+inline rpc::json build_cpustat(sys::CPU const &cpuinfo) {
+  return rpc::json({
+      {"global", cpuinfo.getGlobalStat()},
+      {"separated", cpuinfo.getStats()},
+      {"time", time(nullptr)},
+  });
+}
+
+inline void write_cpustat(json_writer &w, sys::CPU const &cpuinfo) {
+  w.begin_object().key("global");
+  write_json(w, cpuinfo.getGlobalStat());
+  w.key("separated").begin_array();
+  for (auto &stat : cpuinfo.getStats()) write_json(w, stat);
+  w.end_array().field("time", time(nullptr)).end_object();
+}
+
 inline void to_json(rpc::json &j, const cpu_id_t &cpuid) {
   j = rpc::json{
       {"vendor", cpuid.vendor_str},
@@ -0,0 +1,237 @@
+#include "tail.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "syserror.hpp"
+
+static constexpr size_t frame_header = sizeof(uint32_t) + sizeof(uint64_t);
+static constexpr size_t tail_chunk   = 16384;
+static constexpr size_t scan_block   = 65536;
+
+static constexpr uint32_t file_events = IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF;
+static constexpr uint32_t dir_events  = IN_CREATE | IN_MOVED_TO;
+
+tail_manager::tail_manager(std::shared_ptr<binary_handler> binhandler, std::shared_ptr<epoll> ep)
+    : binhandler(std::move(binhandler)), ep(std::move(ep)) {
+  infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (infd == -1) throw syserror("inotify_init1");
+  this->ep->add(EPOLLIN, infd, this->ep->reg([this](const epoll_event &ev) { on_events(); }));
+}
+
+tail_manager::~tail_manager() {
+  for (auto &[path, file] : files)
+    if (file->fd != -1) close(file->fd);
+  ep->del(infd);
+  close(infd);
+}
+
+// Counts newlines backwards from the end in large blocks, a newline ending the file does not start a line. Nothing
+// before the last `max_backlog` bytes would be sent anyway, so the scan stops there.
+off_t tail_manager::last_lines(int fd, off_t size, long lines) {
+  static thread_local char block[scan_block];
+  off_t end   = size;
+  off_t limit = std::max<off_t>(0, size - max_backlog);
+  if (lines == 0) return size;
+  while (end > limit) {
+    off_t begin = std::max<off_t>(limit, end - scan_block);
+    auto len    = pread(fd, block, end - begin, begin);
+    if (len <= 0) break;
+    for (auto i = len; i-- > 0;) {
+      if (block[i] != '\n' || begin + i == size - 1) continue;
+      if (--lines == 0) return begin + i + 1;
+    }
+    end = begin;
+  }
+  return limit;
+}
+
+bool tail_manager::open_file(watched_file &file) {
+  int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+  struct stat st;
+  fstat(fd, &st);
+  file.fd    = fd;
+  file.dev   = st.st_dev;
+  file.ino   = st.st_ino;
+  file.size  = 0;
+  file.moved = false;
+  file.wd    = inotify_add_watch(infd, file.path.c_str(), file_events);
+  if (file.wd != -1) watches[file.wd].insert(&file);
+  return true;
+}
+
+void tail_manager::unwatch(int wd, watched_file &file) {
+  auto it = watches.find(wd);
+  if (it == watches.end()) return;
+  it->second.erase(&file);
+  if (!it->second.empty()) return;
+  inotify_rm_watch(infd, wd);
+  watches.erase(it);
+}
+
+void tail_manager::close_file(watched_file &file) {
+  if (file.wd != -1) unwatch(file.wd, file);
+  if (file.fd != -1) close(file.fd);
+  file.fd = file.wd = -1;
+}
+
+void tail_manager::release(watched_file &file) {
+  close_file(file);
+  if (file.dir_wd != -1) unwatch(file.dir_wd, file);
+  files.erase(file.path);
+}
+
+// Frames share the read buffer, data points `frame_header` bytes into it. Only followers at exactly `offset` are
+// served, so none of their headers overwrite bytes another one is still sent.
+void tail_manager::deliver(watched_file &file, off_t offset, char *data, size_t size, bool drain) {
+  uint64_t off = htobe64(offset);
+  std::memcpy(data - sizeof off, &off, sizeof off);
+  for (auto it = file.subs.begin(); it != file.subs.end();) {
+    auto client = it->client.lock();
+    if (!client) {
+      streams.erase(it->id);
+      it = file.subs.erase(it);
+      continue;
+    }
+    if (it->offset == offset && (drain || !it->waiting)) {
+      uint32_t nid = htonl(it->id);
+      std::memcpy(data - frame_header, &nid, sizeof nid);
+      binhandler->send(client, {data - frame_header, frame_header + size}, binary_handler::priority::bulk);
+      it->offset += size;
+      if (!it->waiting) it->waiting = binhandler->backlogged(client, [this, id = it->id] { resume(id); });
+    }
+    ++it;
+  }
+}
+
+// Reads from the furthest behind follower that can take more until all of them caught up or are waiting, a drain
+// (before the file is reopened) serves the waiting ones as well
+void tail_manager::pump(watched_file &file, bool drain) {
+  static thread_local char buffer[frame_header + tail_chunk];
+  struct stat st;
+  if (file.fd == -1 || fstat(file.fd, &st) != 0) return;
+  if (st.st_size < file.size)
+    for (auto &sub : file.subs) sub.offset = 0;
+  file.size = st.st_size;
+  for (;;) {
+    off_t from = file.size;
+    for (auto &sub : file.subs)
+      if (drain || !sub.waiting) from = std::min(from, sub.offset);
+    if (from >= file.size) break;
+    auto len = pread(file.fd, buffer + frame_header, std::min<off_t>(tail_chunk, file.size - from), from);
+    if (len <= 0) break;
+    deliver(file, from, buffer + frame_header, len, drain);
+  }
+}
+
+void tail_manager::resume(uint32_t id) {
+  auto it = streams.find(id);
+  if (it == streams.end()) return;
+  auto &file = *it->second;
+  for (auto &sub : file.subs)
+    if (sub.id == id) sub.waiting = false;
+  pump(file);
+  if (file.subs.empty()) release(file);
+}
+
+// After a rename or unlink the old inode is drained, then the path is followed again once something is there
+void tail_manager::check_rotation(watched_file &file) {
+  struct stat st;
+  if (stat(file.path.c_str(), &st) != 0) return;
+  if (file.fd != -1 && st.st_dev == file.dev && st.st_ino == file.ino) {
+    file.moved = false;
+    return;
+  }
+  pump(file, true);
+  close_file(file);
+  if (!open_file(file)) return;
+  for (auto &sub : file.subs) sub.offset = 0;
+  pump(file);
+}
+
+void tail_manager::on_events() {
+  alignas(inotify_event) char buf[16384];
+  std::set<watched_file *> modified, rotated;
+  ssize_t len;
+  while ((len = read(infd, buf, sizeof buf)) > 0) {
+    for (char *ptr = buf; ptr < buf + len;) {
+      auto ev = (inotify_event const *) ptr;
+      ptr += sizeof(inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        for (auto &[path, file] : files) rotated.insert(file.get());
+        continue;
+      }
+      auto it = watches.find(ev->wd);
+      if (it == watches.end()) continue;
+      if (ev->mask & IN_IGNORED) {
+        for (auto file : it->second) {
+          if (file->wd == ev->wd) file->wd = -1;
+          if (file->dir_wd == ev->wd) file->dir_wd = -1;
+        }
+        watches.erase(it);
+        continue;
+      }
+      for (auto file : it->second) {
+        if (file->wd == ev->wd) {
+          if (ev->mask & IN_MODIFY) modified.insert(file);
+          if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) file->moved = true;
+        } else if (ev->len && file->name == ev->name)
+          rotated.insert(file);
+      }
+    }
+  }
+  for (auto file : modified) pump(*file);
+  std::vector<watched_file *> idle;
+  for (auto &[path, file] : files) {
+    if (file->moved || rotated.count(file.get())) check_rotation(*file);
+    if (file->subs.empty()) idle.push_back(file.get());
+  }
+  // Followers whose client went away were dropped while delivering
+  for (auto file : idle) release(*file);
+}
+
+tail_manager::position
+tail_manager::follow(client_handler client, uint32_t id, std::string const &path, off_t offset, long lines) {
+  auto abs = std::filesystem::absolute(path).lexically_normal();
+  auto it  = files.find(abs.string());
+  if (it == files.end()) {
+    auto file  = std::make_unique<watched_file>();
+    file->path = abs.string();
+    file->dir  = abs.parent_path().string();
+    file->name = abs.filename().string();
+    if (!open_file(*file)) throw syserror("open");
+    file->dir_wd = inotify_add_watch(infd, file->dir.c_str(), dir_events | IN_ONLYDIR);
+    if (file->dir_wd != -1) watches[file->dir_wd].insert(file.get());
+    it = files.emplace(file->path, std::move(file)).first;
+  }
+  auto &file = *it->second;
+  struct stat st;
+  if (fstat(file.fd, &st) != 0) throw syserror("fstat");
+  off_t end   = st.st_size;
+  off_t start = lines >= 0 ? last_lines(file.fd, end, lines) : std::min(offset, end);
+  start       = std::max(start, end - max_backlog);
+  // The backlog is read like any other lag, as fast as the client takes it
+  file.subs.push_back({client, id, start});
+  streams[id] = &file;
+  pump(file);
+  return {start, end};
+}
+
+void tail_manager::cancel(client_handler client, uint32_t id) {
+  auto it = streams.find(id);
+  if (it == streams.end()) return;
+  auto &file = *it->second;
+  auto sub   = std::find_if(file.subs.begin(), file.subs.end(), [&](auto &sub) { return sub.id == id; });
+  if (sub == file.subs.end() || sub->client.lock() != client) throw std::invalid_argument("stream not found");
+  file.subs.erase(sub);
+  streams.erase(it);
+  if (file.subs.empty()) release(file);
+}
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <epoll.hpp>
+#include <map>
+#include <memory>
+#include <rpc.hpp>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_handler.hpp"
+
+// Follows files for the clients of one reactor through inotify. Followers at the same offset share every read, each of
+// them gets the bytes at or after its own offset as frames of [stream id, 32 bit BE][file offset, 64 bit BE][data].
+// A follower whose client has a bulk backlog is not read for until it drained. The offset dropping back to 0 means the
+// file was truncated or replaced (rotation).
+class tail_manager {
+public:
+  using client_handler = rpc::RPC::client_handler;
+  // Oldest byte a new follower is sent, relative to the end of the file
+  static constexpr off_t max_backlog = 16 << 20;
+
+  tail_manager(std::shared_ptr<binary_handler> binhandler, std::shared_ptr<epoll> ep);
+  tail_manager(tail_manager const &) = delete;
+  ~tail_manager();
+
+  struct position {
+    off_t offset, size;
+  };
+  // Starts at `offset`, or at the start of the last `lines` lines when lines >= 0
+  position follow(client_handler, uint32_t id, std::string const &path, off_t offset, long lines);
+  void cancel(client_handler, uint32_t id);
+
+private:
+  struct subscriber {
+    std::weak_ptr<rpc::server_io::client> client;
+    uint32_t id;
+    off_t offset;
+    // The client is backlogged, reading resumes once it drained
+    bool waiting = false;
+  };
+  struct watched_file {
+    std::string path, dir, name;
+    int fd = -1, wd = -1, dir_wd = -1;
+    dev_t dev;
+    ino_t ino;
+    // Size seen by the last read, shrinking means truncation
+    off_t size = 0;
+    bool moved = false;
+    std::vector<subscriber> subs;
+  };
+
+  std::shared_ptr<binary_handler> binhandler;
+  std::shared_ptr<epoll> ep;
+  int infd;
+  std::map<std::string, std::unique_ptr<watched_file>> files;
+  // A watch descriptor is shared by every file on the same inode (or in the same directory)
+  std::unordered_map<int, std::set<watched_file *>> watches;
+  std::unordered_map<uint32_t, watched_file *> streams;
+
+  void on_events();
+  bool open_file(watched_file &file);
+  void close_file(watched_file &file);
+  void unwatch(int wd, watched_file &file);
+  void pump(watched_file &file, bool drain = false);
+  void resume(uint32_t id);
+  void check_rotation(watched_file &file);
+  void deliver(watched_file &file, off_t offset, char *data, size_t size, bool drain);
+  void release(watched_file &file);
+  static off_t last_lines(int fd, off_t size, long lines);
+};
\ No newline at end of file
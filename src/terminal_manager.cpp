@@ -1,7 +1,9 @@
 #include "terminal_manager.hpp"
 #include <csignal>
 #include <cstring>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <optional>
 #include <pty.h>
 #include <signal.h>
 #include <stdexcept>
@@ -9,25 +11,95 @@
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "syserror.hpp"
+
 static constexpr auto magic = (1ul << 31);
 
-terminal_manager::terminal_manager(std::shared_ptr<callback> cb, std::shared_ptr<epoll> ep)
-    : callback_ref(std::move(cb)), ep(ep) {
-  chld     = ep->reg([this](const epoll_event &ev) {
+#ifndef SYS_pidfd_open
+#  define SYS_pidfd_open 434
+#endif
+
+static int pidfd_open(pid_t pid) { return syscall(SYS_pidfd_open, pid, 0); }
+
+// Reads of every pty, all on the home loop
+static char shared_buffer[32767 + sizeof(terminal_manager::ID)];
+
+// Output of the child's last moments may still sit in the pty, it is delivered before the terminal closes. Only ever
+// runs on the home loop, like the reads of pty_read. A grandchild holding the pty open can keep writing to it, so no more
+// than the tty layer buffers is read.
+void terminal_manager::drain(ID id) {
+  fcntl(id, F_SETFL, fcntl(id, F_GETFL) | O_NONBLOCK);
+  ssize_t len;
+  for (size_t total = 0;
+       total < max_drain && (len = read_frame(id, shared_buffer, sizeof shared_buffer)) > (ssize_t) sizeof(ID);
+       total += len - sizeof(ID))
+    callback_ref->on_data(id, {shared_buffer, (size_t) len});
+}
+
+void terminal_manager::on_exit(pid_t pid, int status, rusage const *usage) {
+  std::unique_lock lock{mtx};
+  // Whichever of the pidfd and the SIGCHLD drain saw the exit first reaped it, the pidfd is done with either way
+  if (auto watch = pidfds.find(pid); watch != pidfds.end()) {
+    ep->del(watch->second);
+    close(watch->second);
+    watched.erase(watch->second);
+    pidfds.erase(watch);
+  }
+  auto it = pidset.get<pid_t>().find(pid);
+  if (it == pidset.get<pid_t>().end()) {
+    if (!starting || !usage) return;
+    if (unclaimed.size() == max_unclaimed) unclaimed.erase(unclaimed.begin());
+    unclaimed.push_back({pid, status, *usage});
+    return;
+  }
+  auto id = it->id;
+  pidset.erase(it);
+  paused.erase(id);
+  if (polled.erase(id)) ep->del(id);
+  lock.unlock();
+  drain(id);
+  if (usage) callback_ref->on_exit(id, status, *usage);
+  callback_ref->on_close(id);
+  // Only now, a terminal started meanwhile could otherwise get the number while the old one is still linked
+  close(id);
+}
+
+terminal_manager::terminal_manager(
+    std::shared_ptr<callback> cb, std::shared_ptr<epoll> ep, std::shared_ptr<spawner> spawn)
+    : callback_ref(std::move(cb)), ep(ep), spawn(std::move(spawn)), home(mailbox::current) {
+  // Each child is watched through its own pidfd, reaped and reported on its own. SIGCHLD, which coalesces, is drained
+  // as well: it reaps every exited child, including those that are not terminals (pooled shells of the spawner, the
+  // spawner itself) and all of them on kernels without pidfd_open.
+  if (int self = pidfd_open(getpid()); self != -1) {
+    close(self);
+    use_pidfd = true;
+  }
+  child_exit = ep->reg([this](const epoll_event &ev) {
+    std::unique_lock lock{mtx};
+    auto it = watched.find(ev.data.fd);
+    if (it == watched.end()) return;
+    auto pid = it->second;
+    lock.unlock();
+    int status = 0;
+    rusage usage;
+    auto ret = wait4(pid, &status, WNOHANG, &usage);
+    if (ret == 0 || (ret == -1 && errno == EINTR)) return;
+    // Nothing left to reap (ECHILD) means the status is lost, the terminal is closed without an exit report
+    on_exit(pid, status, ret == -1 ? nullptr : &usage);
+  });
+  chld = ep->reg([this](const epoll_event &ev) {
     if (ev.events & EPOLLIN) {
       signalfd_siginfo info;
-      read(sigfd, &info, sizeof info);
-      auto pid = wait(nullptr);
-      auto it  = pidset.get<pid_t>().find(pid);
-      if (it == pidset.get<pid_t>().end()) return;
-      auto id  = it->id;
-      this->ep->del(id);
-      callback_ref->on_close(id);
-      pidset.erase(it);
+      while (read(sigfd, &info, sizeof info) > 0) {}
+      int status;
+      rusage usage;
+      pid_t pid;
+      while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) on_exit(pid, status, &usage);
     } else {
       this->ep->del(sigfd);
       close(sigfd);
@@ -35,15 +107,18 @@ terminal_manager::terminal_manager(std::shared_ptr<callback> cb, std::shared_ptr
   });
   pty_read = ep->reg([this](const epoll_event &ev) {
     if (ev.events & EPOLLIN) {
-      static char shared_buffer[32767 + sizeof(ID)];
-      auto len = read(ev.data.fd, shared_buffer + sizeof(ID), sizeof shared_buffer - sizeof(ID));
-      ID nid   = htonl(ev.data.fd | magic);
-      std::memcpy(shared_buffer, &nid, sizeof nid);
+      auto len = read_frame(ev.data.fd, shared_buffer, sizeof shared_buffer);
       if (len == -1) return;
-      callback_ref->on_data(ev.data.fd, {shared_buffer, len + sizeof nid});
+      callback_ref->on_data(ev.data.fd, {shared_buffer, (size_t) len});
     } else {
+      // A hung up pty of a live terminal is closed with its terminal, so the fd number cannot be reused meanwhile
+      std::unique_lock lock{mtx};
       this->ep->del(ev.data.fd);
-      close(ev.data.fd);
+      polled.erase(ev.data.fd);
+      if (pidset.get<ID>().count(ev.data.fd))
+        paused.insert(ev.data.fd);
+      else
+        close(ev.data.fd);
     }
   });
 
@@ -53,42 +128,155 @@ terminal_manager::terminal_manager(std::shared_ptr<callback> cb, std::shared_ptr
   sigprocmask(SIG_BLOCK, &sigset, NULL);
   sigfd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
   ep->add(EPOLLIN | EPOLLERR, sigfd, chld);
+  callback_ref->manager = this;
 }
 
-const constexpr static winsize default_winsize = {80, 25};
-
-terminal_manager::ID
-terminal_manager::alloc_terminal(std::string const &program, std::vector<std::string> const &args) {
-  int master;
-  int ret = forkpty(&master, nullptr, nullptr, &default_winsize);
+// Falls back to forking here once the helper is gone
+pid_t terminal_manager::start_child(std::string const &program, std::vector<std::string> const &args, int &master) {
+  if (auto child = spawn ? spawn->spawn(program, args, default_winsize) : std::nullopt) {
+    master = child->master;
+    return child->pid;
+  }
+  // No allocation is allowed in the child of a multithreaded process, so argv is built before forking
+  std::vector<char const *> argv;
+  for (auto &str : args) argv.push_back(str.c_str());
+  argv.push_back(nullptr);
+  pid_t ret = forkpty(&master, nullptr, nullptr, &default_winsize);
   if (ret == 0) {
-    prctl(PR_GET_PDEATHSIG, SIGHUP);
-    auto argv = new char const *[args.size() + 1];
-    auto it   = argv;
-    for (auto &str : args) *it++ = str.c_str();
-    *it = nullptr;
-    exit(execvp(program.c_str(), (char **) argv));
+    prctl(PR_SET_PDEATHSIG, SIGHUP);
+    _exit(execvp(program.c_str(), (char **) argv.data()));
   }
+  if (ret == -1) throw syserror("forkpty");
+  return ret;
+}
+
+terminal_manager::ID terminal_manager::alloc_terminal(
+    std::string const &program, std::vector<std::string> const &args, std::function<void(ID)> const &link) {
+  std::unique_lock lock{mtx};
+  starting++;
+  lock.unlock();
+  int master = -1;
+  pid_t ret  = -1;
+  try {
+    ret = start_child(program, args, master);
+    // Until it is recorded an exit is only kept, so the home loop cannot close the pty (and free its number) first
+    if (link) link(master);
+  } catch (...) {
+    if (ret != -1) {
+      kill(ret, SIGKILL);
+      close(master);
+    }
+    lock.lock();
+    if (--starting == 0) unclaimed.clear();
+    throw;
+  }
+  lock.lock();
   pidset.insert({ret, (ID) master});
-  ep->add(EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, master, pty_read);
+  std::optional<unclaimed_exit> exited;
+  for (auto it = unclaimed.begin(); it != unclaimed.end(); ++it)
+    if (it->pid == ret) {
+      exited = *it;
+      unclaimed.erase(it);
+      break;
+    }
+  if (--starting == 0) unclaimed.clear();
+  // Without a pidfd (the child was reaped already, or none is left) the SIGCHLD drain still reports the exit
+  int pidfd = exited || !use_pidfd ? -1 : pidfd_open(ret);
+  if (pidfd != -1) {
+    watched.emplace(pidfd, ret);
+    pidfds.emplace(ret, pidfd);
+  }
+  lock.unlock();
+  if (pidfd != -1)
+    on_home([=] {
+      std::lock_guard lock{mtx};
+      if (auto it = watched.find(pidfd); it != watched.end() && it->second == ret) ep->add(EPOLLIN, pidfd, child_exit);
+    });
+  callback_ref->on_open(master, program, args);
+  sync_poll(master);
+  // Reaped before it was recorded, reported now that it is
+  if (exited) on_home([=, gone = *exited] { on_exit(gone.pid, gone.status, &gone.usage); });
   return master;
 }
 
+void terminal_manager::on_home(std::function<void()> task) {
+  if (home)
+    home->dispatch(std::move(task));
+  else
+    task();
+}
+
+// Brings the registration of the pty in line with whatever terminal has the number by the time this runs on the home
+// loop: meanwhile it may have been paused again, closed, or its number may have gone to a newer terminal
+void terminal_manager::sync_poll(ID id) {
+  on_home([=] {
+    std::lock_guard lock{mtx};
+    bool want = pidset.get<ID>().count(id) && !paused.count(id);
+    if (want == (polled.count(id) != 0)) return;
+    if (want) {
+      ep->add(EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP, id, pty_read);
+      polled.insert(id);
+    } else {
+      ep->del(id);
+      polled.erase(id);
+    }
+  });
+}
+
 void terminal_manager::resize_terminal(terminal_manager::ID id, winsize size) {
+  std::lock_guard lock{mtx};
   if (pidset.get<ID>().count(id) == 0) throw std::invalid_argument("id not found");
   ioctl(id, TIOCSWINSZ, &size);
 }
 
 void terminal_manager::send_data(terminal_manager::ID id, std::string_view data) {
+  std::lock_guard lock{mtx};
   if (pidset.get<ID>().count(id) == 0) throw std::invalid_argument("id not found");
   write(id, data.data(), data.size());
 }
 
 void terminal_manager::close_terminal(terminal_manager::ID id) {
+  std::unique_lock lock{mtx};
   auto it = pidset.get<ID>().find(id);
   if (it == pidset.get<ID>().end()) throw std::invalid_argument("id not found");
   pidset.get<ID>().erase(it);
-  ep->del(id);
+  paused.erase(id);
+  lock.unlock();
   callback_ref->on_close(id);
-  close(id);
+  on_home([=] {
+    {
+      std::lock_guard lock{mtx};
+      if (polled.erase(id)) ep->del(id);
+    }
+    close(id);
+  });
+}
+
+void terminal_manager::pause_terminal(terminal_manager::ID id) {
+  {
+    std::lock_guard lock{mtx};
+    if (pidset.get<ID>().count(id) == 0 || !paused.insert(id).second) return;
+  }
+  sync_poll(id);
+}
+
+void terminal_manager::resume_terminal(terminal_manager::ID id) {
+  {
+    std::lock_guard lock{mtx};
+    if (pidset.get<ID>().count(id) == 0 || paused.erase(id) == 0) return;
+  }
+  sync_poll(id);
+}
+
+ssize_t terminal_manager::read_frame(int fd, char *buffer, size_t capacity) {
+  auto len = read(fd, buffer + sizeof(ID), capacity - sizeof(ID));
+  if (len == -1) return -1;
+  ID nid = htonl(fd | magic);
+  std::memcpy(buffer, &nid, sizeof nid);
+  return len + sizeof nid;
+}
+
+size_t terminal_manager::count() {
+  std::lock_guard lock{mtx};
+  return pidset.size();
 }
\ No newline at end of file
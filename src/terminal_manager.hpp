@@ -7,19 +7,33 @@
 #include <boost/multi_index_container.hpp>
 #include <cstdint>
 #include <epoll.hpp>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <pty.h>
 #include <sched.h>
 #include <set>
 #include <string_view>
+#include <sys/resource.h>
+#include <unordered_map>
+#include <vector>
+
+#include "mailbox.hpp"
+#include "spawner.hpp"
 
 class terminal_manager {
 public:
-  using ID = uint32_t;
+  using ID                                 = uint32_t;
+  static constexpr winsize default_winsize = {80, 25};
   struct callback {
     virtual void on_data(ID, std::string_view) = 0;
     virtual void on_close(ID)                  = 0;
+    // Called before the pty is polled, so no output can precede it
+    virtual void on_open(ID, std::string const &program, std::vector<std::string> const &args) {}
+    // The child was reaped, called right before on_close
+    virtual void on_exit(ID, int status, rusage const &usage) {}
+    terminal_manager *manager                  = nullptr;
   };
 
 private:
@@ -36,12 +50,52 @@ private:
                        boost::multi_index::tag<ID>, boost::multi_index::member<pidpair, ID, &pidpair::id>>>>
       pidset;
   std::shared_ptr<epoll> ep;
-  int sigfd, chld, pty_read;
+  // Starts the programs when set, the server forks them itself otherwise
+  std::shared_ptr<spawner> spawn;
+  // Terminals are polled by the loop that created the manager, other reactors post their epoll changes to it
+  mailbox *home;
+  std::mutex mtx;
+  std::set<ID> paused;
+  // Ptys registered with the epoll, only changed on the home loop
+  std::set<ID> polled;
+  // pidfd -> pid of every child not reaped yet, and back
+  std::unordered_map<int, pid_t> watched;
+  std::unordered_map<pid_t, int> pidfds;
+  bool use_pidfd = false;
+  int sigfd, chld, child_exit, pty_read;
+  // A child can be reaped before alloc_terminal recorded it, while any is being started unknown exits are kept
+  struct unclaimed_exit {
+    pid_t pid;
+    int status;
+    rusage usage;
+  };
+  static constexpr size_t max_unclaimed = 64;
+  unsigned starting = 0;
+  std::vector<unclaimed_exit> unclaimed;
+
+  void on_home(std::function<void()> task);
+  void sync_poll(ID id);
+  // Runs without the lock, the helper round trip or fork must not hold up the other reactors
+  pid_t start_child(std::string const &program, std::vector<std::string> const &args, int &master);
+  // Roughly what the tty layer buffers behind a pty (its flip buffer limit)
+  static constexpr size_t max_drain = 65536;
+  void drain(ID id);
+  // usage is null when the exit status could not be collected
+  void on_exit(pid_t pid, int status, rusage const *usage);
 
 public:
-  terminal_manager(std::shared_ptr<callback> cb, std::shared_ptr<epoll> ep);
-  ID alloc_terminal(std::string const &program, std::vector<std::string> const &args);
+  terminal_manager(std::shared_ptr<callback> cb, std::shared_ptr<epoll> ep, std::shared_ptr<spawner> spawn = nullptr);
+  // `link` gets the new terminal before anything can be reported about it, not even its exit
+  ID alloc_terminal(
+      std::string const &program, std::vector<std::string> const &args, std::function<void(ID)> const &link = {});
   void resize_terminal(ID id, winsize size);
   void send_data(ID id, std::string_view data);
   void close_terminal(ID id);
+  // A paused pty is not polled, once its kernel buffer fills the child blocks on write
+  void pause_terminal(ID id);
+  void resume_terminal(ID id);
+  size_t count();
+
+  // Reads what the pty has behind a frame header for it, returns the frame length or -1
+  static ssize_t read_frame(int fd, char *buffer, size_t capacity);
 };
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <memory>
 #include <sys/timerfd.h>
 
+#include "stats.hpp"
+
 template <typename Callback> class Timer {
   int timerfd;
   std::shared_ptr<epoll> epfd;
@@ -16,12 +18,17 @@ public:
     timer.it_interval.tv_sec = sec;
     timerfd_settime(timerfd, 0, &timer, nullptr);
 
-    epfd->add(EPOLLIN | EPOLLERR, timerfd, epfd->reg([this, callback](const epoll_event &ev) {
+    epfd->add(EPOLLIN | EPOLLERR, timerfd, epfd->reg([this, sec, callback](const epoll_event &ev) {
       if (ev.events & EPOLLERR) {
         epfd->del(timerfd);
       } else if (ev.events & EPOLLIN) {
         char buffer[8];
         read(timerfd, buffer, 8);
+        // How late the loop got to the expiry, the timer has been counting down toward the next one since
+        itimerspec remaining;
+        timerfd_gettime(timerfd, &remaining);
+        int64_t lag = sec * 1000000000ll - (remaining.it_value.tv_sec * 1000000000ll + remaining.it_value.tv_nsec);
+        server_stats::global().loop_lag.record(lag > 0 ? lag : 0);
         callback();
       }
     }));
@@ -0,0 +1,93 @@
+#include "uring.hpp"
+#include <cstdint>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "mailbox.hpp"
+
+#ifdef HAVE_LIBURING
+
+uring::uring(std::shared_ptr<epoll> ep)
+    : ep(std::move(ep)), buffers(slots * (slot_capacity + headroom)), requests(slots) {
+  for (unsigned i = slots; i > 0; i--) free_slots.push_back(i - 1);
+}
+
+std::unique_ptr<uring> uring::create(std::shared_ptr<epoll> ep) {
+  std::unique_ptr<uring> self{new uring(std::move(ep))};
+  if (io_uring_queue_init(slots, &self->ring, 0) < 0) return nullptr;
+  std::vector<iovec> iov(slots);
+  for (unsigned i = 0; i < slots; i++)
+    iov[i] = {self->buffers.data() + i * (slot_capacity + headroom), slot_capacity + headroom};
+  int evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (evfd == -1 || io_uring_register_eventfd(&self->ring, evfd) < 0 ||
+      io_uring_register_buffers(&self->ring, iov.data(), slots) < 0) {
+    if (evfd != -1) close(evfd);
+    io_uring_queue_exit(&self->ring);
+    return nullptr;
+  }
+  self->evfd = evfd;
+  self->ep->add(EPOLLIN, evfd, self->ep->reg([ptr = self.get()](const epoll_event &) { ptr->reap(); }));
+  return self;
+}
+
+uring::~uring() {
+  if (evfd == -1) return;
+  ep->del(evfd);
+  close(evfd);
+  io_uring_queue_exit(&ring);
+  for (unsigned slot = 0; slot < slots; slot++)
+    if (requests[slot].cb) close(requests[slot].fd);
+}
+
+bool uring::read(int fd, size_t size, off_t offset, completion cb) {
+  if (free_slots.empty() || size > slot_capacity) return false;
+  auto sqe = io_uring_get_sqe(&ring);
+  if (!sqe) return false;
+  auto slot = free_slots.back();
+  free_slots.pop_back();
+  auto base = buffers.data() + slot * (slot_capacity + headroom);
+  io_uring_prep_read_fixed(sqe, fd, base + headroom, size, offset, slot);
+  io_uring_sqe_set_data(sqe, (void *) (uintptr_t) slot);
+  requests[slot] = {fd, std::move(cb)};
+  // Everything queued during this loop iteration goes out with a single io_uring_enter
+  if (!flush_pending) {
+    flush_pending = true;
+    if (mailbox::current)
+      mailbox::current->post([this] { flush(); });
+    else
+      flush();
+  }
+  return true;
+}
+
+void uring::flush() {
+  flush_pending = false;
+  io_uring_submit(&ring);
+}
+
+void uring::reap() {
+  uint64_t count;
+  ::read(evfd, &count, sizeof count);
+  io_uring_cqe *cqe;
+  while (io_uring_peek_cqe(&ring, &cqe) == 0) {
+    auto slot = (unsigned) (uintptr_t) io_uring_cqe_get_data(cqe);
+    auto res  = cqe->res;
+    io_uring_cqe_seen(&ring, cqe);
+    auto req = std::move(requests[slot]);
+    requests[slot].cb = nullptr;
+    close(req.fd);
+    // The slot is only reused by a later read, the callback can still use its data
+    free_slots.push_back(slot);
+    auto base = buffers.data() + slot * (slot_capacity + headroom);
+    req.cb(res, base, headroom + (res > 0 ? res : 0));
+  }
+}
+
+#else
+
+std::unique_ptr<uring> uring::create(std::shared_ptr<epoll> ep) { return nullptr; }
+uring::~uring() {}
+bool uring::read(int fd, size_t size, off_t offset, completion cb) { return false; }
+
+#endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <epoll.hpp>
+#include <functional>
+#include <memory>
+#include <sys/types.h>
+#include <vector>
+#ifdef HAVE_LIBURING
+#  include <liburing.h>
+#endif
+
+// Asynchronous preads through io_uring into registered buffers, completions are reaped on the epoll loop.
+class uring {
+public:
+  // data points at `headroom` spare bytes followed by what was read, so the frame header can be written in place
+  using completion                      = std::function<void(int res, char *data, size_t size)>;
+  static constexpr size_t headroom      = 4;
+  static constexpr unsigned slots       = 64;
+  static constexpr size_t slot_capacity = 16384;
+
+  // Returns nullptr when io_uring is not compiled in or not usable on this kernel
+  static std::unique_ptr<uring> create(std::shared_ptr<epoll> ep);
+  ~uring();
+
+  // Takes ownership of fd, returns false (keeping fd) when the ring is full so the caller can fall back
+  bool read(int fd, size_t size, off_t offset, completion cb);
+
+private:
+  uring(std::shared_ptr<epoll> ep);
+  void flush();
+  void reap();
+
+  std::shared_ptr<epoll> ep;
+  int evfd = -1;
+  bool flush_pending = false;
+  std::vector<char> buffers;
+  std::vector<unsigned> free_slots;
+  struct request {
+    int fd;
+    completion cb;
+  };
+  std::vector<request> requests;
+#ifdef HAVE_LIBURING
+  io_uring ring;
+#endif
+};
\ No newline at end of file
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads started once and shared by every reactor. run() spreads the items of a call over the idle
+// workers and the calling thread, which works on them too, so a call finishes even while all workers are busy with
+// the calls of other reactors.
+class worker_pool {
+  struct job {
+    std::function<void(size_t)> const &fn;
+    size_t count;
+    std::atomic<size_t> next{0};
+    // Workers inside fn, guarded by mtx
+    size_t busy = 0;
+    std::exception_ptr error;
+    std::mutex mtx;
+    std::condition_variable idle;
+
+    job(std::function<void(size_t)> const &fn, size_t count) : fn(fn), count(count) {}
+    void work() {
+      for (size_t i; (i = next++) < count;) {
+        try {
+          fn(i);
+        } catch (...) {
+          std::lock_guard lock{mtx};
+          if (!error) error = std::current_exception();
+        }
+      }
+    }
+  };
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<job>> jobs;
+  bool stopping = false;
+  std::vector<std::thread> threads;
+
+  void loop() {
+    // Signals are for the reactors (SIGCHLD goes to a signalfd), none may be delivered to a worker
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, nullptr);
+    for (;;) {
+      std::shared_ptr<job> current;
+      {
+        std::unique_lock lock{mtx};
+        cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping) return;
+        current = std::move(jobs.front());
+        jobs.pop_front();
+      }
+      // The caller may have taken every item already and returned, fn is only touched while it waits for busy
+      {
+        std::lock_guard lock{current->mtx};
+        if (current->next >= current->count) continue;
+        current->busy++;
+      }
+      current->work();
+      std::lock_guard lock{current->mtx};
+      if (--current->busy == 0) current->idle.notify_all();
+    }
+  }
+
+public:
+  worker_pool(unsigned size) {
+    for (unsigned i = 0; i < size; i++) threads.emplace_back([this] { loop(); });
+  }
+  worker_pool(worker_pool const &) = delete;
+  ~worker_pool() {
+    {
+      std::lock_guard lock{mtx};
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &thread : threads) thread.join();
+  }
+
+  // Calls fn(0) .. fn(count - 1) in no particular order and returns once all of them did, rethrowing the first
+  // exception one of them threw
+  void run(size_t count, std::function<void(size_t)> const &fn) {
+    auto current = std::make_shared<job>(fn, count);
+    if (auto helpers = std::min<size_t>(threads.size(), count ? count - 1 : 0)) {
+      {
+        std::lock_guard lock{mtx};
+        for (size_t i = 0; i < helpers; i++) jobs.push_back(current);
+      }
+      cv.notify_all();
+    }
+    current->work();
+    std::unique_lock lock{current->mtx};
+    current->idle.wait(lock, [&] { return current->busy == 0; });
+    if (current->error) std::rethrow_exception(current->error);
+  }
+};
\ No newline at end of file
@@ -0,0 +1,117 @@
+// Unpacks hostile archives below a scratch directory and checks nothing lands outside of it.
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "../src/archive.hpp"
+
+namespace fs = std::filesystem;
+
+static int failures = 0;
+
+static void expect(bool ok, std::string const &what) {
+  if (ok) return;
+  std::cerr << "FAIL: " << what << std::endl;
+  failures++;
+}
+
+static std::string entry(std::string const &name, char type, std::string const &data = {}, std::string link = {}) {
+  std::string block(512, '\0');
+  auto h = block.data();
+  name.copy(h, 100);
+  std::snprintf(h + 100, 8, "%07o", type == '5' ? 0755 : 0644);
+  std::snprintf(h + 108, 8, "%07o", 0);
+  std::snprintf(h + 116, 8, "%07o", 0);
+  std::snprintf(h + 124, 12, "%011zo", data.size());
+  std::snprintf(h + 136, 12, "%011o", 0);
+  h[156] = type;
+  link.copy(h + 157, 100);
+  std::memcpy(h + 257, "ustar  ", 8);
+  unsigned sum = 0;
+  for (size_t i = 0; i < 512; i++) sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) h[i];
+  std::snprintf(h + 148, 8, "%06o", sum);
+  block += data;
+  block.append((512 - data.size() % 512) % 512, '\0');
+  return block;
+}
+
+static std::string finish(std::string archive) { return archive + std::string(1024, '\0'); }
+
+static std::string slurp(fs::path const &path) {
+  std::ostringstream ss;
+  ss << std::ifstream{path}.rdbuf();
+  return ss.str();
+}
+
+// Feeds the archive in small pieces, returns whether it was rejected
+static bool rejected(fs::path const &root, std::string const &archive) {
+  try {
+    tar_reader reader{root, false};
+    for (size_t pos = 0; pos < archive.size(); pos += 100)
+      reader.feed(std::string_view{archive}.substr(pos, 100));
+    return false;
+  } catch (std::exception const &) { return true; }
+}
+
+int main() {
+  char tmpl[] = "/tmp/bedweb-archive-test-XXXXXX";
+  fs::path scratch{mkdtemp(tmpl)};
+  auto outside = scratch / "outside";
+  fs::create_directories(outside);
+  std::ofstream{outside / "passwd"} << "untouched";
+  auto run = [&](std::string const &name, std::function<void(fs::path const &)> check) {
+    auto root = scratch / name;
+    fs::create_directories(root);
+    check(root);
+  };
+
+  run("absolute-symlink", [&](fs::path const &root) {
+    auto archive = finish(entry("link", '2', {}, outside.string()) + entry("link/passwd", '0', "owned"));
+    expect(rejected(root, archive), "symlink to an absolute path is refused");
+    expect(slurp(outside / "passwd") == "untouched", "absolute symlink does not redirect writes");
+  });
+  run("escaping-symlink", [&](fs::path const &root) {
+    auto archive = finish(entry("dir/", '5') + entry("dir/link", '2', {}, "../../outside"));
+    expect(rejected(root, archive), "symlink climbing out of root is refused");
+    expect(!fs::is_symlink(root / "dir/link"), "escaping symlink is not created");
+  });
+  run("inner-symlink", [&](fs::path const &root) {
+    auto archive = finish(entry("dir/", '5') + entry("dir/link", '2', {}, "../file") + entry("file", '0', "data"));
+    expect(!rejected(root, archive), "symlink staying inside root is accepted");
+    expect(fs::read_symlink(root / "dir/link") == "../file", "inner symlink is created as is");
+    expect(slurp(root / "file") == "data", "regular file is written");
+  });
+  run("through-existing-symlink", [&](fs::path const &root) {
+    fs::create_directory_symlink(outside, root / "evil");
+    expect(rejected(root, finish(entry("evil/passwd", '0', "owned"))), "path through an existing symlink is refused");
+    expect(slurp(outside / "passwd") == "untouched", "existing symlink does not redirect writes");
+  });
+  run("over-existing-symlink", [&](fs::path const &root) {
+    fs::create_symlink(outside / "passwd", root / "target");
+    expect(!rejected(root, finish(entry("target", '0', "replaced"))), "entry over an existing symlink is accepted");
+    expect(!fs::is_symlink(root / "target") && slurp(root / "target") == "replaced", "existing symlink is replaced");
+    expect(slurp(outside / "passwd") == "untouched", "existing symlink is not written through");
+  });
+  run("dot-dot", [&](fs::path const &root) {
+    expect(rejected(root, finish(entry("../outside/passwd", '0', "owned"))), "relative escape is refused");
+    expect(rejected(root, finish(entry("/tmp/absolute", '0', "owned"))), "absolute name is refused");
+    expect(slurp(outside / "passwd") == "untouched", "escaping names do not write");
+  });
+  run("hardlink", [&](fs::path const &root) {
+    expect(rejected(root, finish(entry("link", '1', {}, (outside / "passwd").string()))), "absolute hardlink is refused");
+    expect(rejected(root, finish(entry("link", '1', {}, "../outside/passwd"))), "escaping hardlink is refused");
+    expect(!fs::exists(root / "link"), "escaping hardlink is not created");
+  });
+
+  fs::remove_all(scratch);
+  if (failures) return 1;
+  std::cout << "archive: all checks passed" << std::endl;
+  return 0;
+}
\ No newline at end of file